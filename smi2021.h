@@ -31,11 +31,24 @@
 #ifndef SMI2021_H
 #define SMI2021_H
 
+#include <linux/version.h>
 #include <linux/module.h>
 #include <linux/usb.h>
 #include <linux/i2c.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/circ_buf.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 12, 0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
@@ -54,6 +67,8 @@
 #include <sound/pcm_params.h>
 #include <sound/initval.h>
 
+#include "smi2021_uapi.h"
+
 #ifndef GITVERSION
 #define GITVERSION ""
 #endif
@@ -64,6 +79,16 @@
 #define SMI2021_ISOC_PACKETS	10
 #define SMI2021_ISOC_EP		0x82
 
+/* Limits for the isoc controls, and the adaptive mode */
+#define SMI2021_ISOC_TRANSFERS_MIN	2
+#define SMI2021_ISOC_TRANSFERS_MAX	64
+#define SMI2021_ISOC_PACKETS_MAX	32
+#define SMI2021_ISOC_ADAPT_BUSY		3	/* seconds */
+#define SMI2021_ISOC_ADAPT_IDLE		10	/* seconds */
+
+/* Urbs parsed in one run before the other devices get their turn */
+#define SMI2021_POOL_BATCH		8
+
 /* General USB control setup */
 #define SMI2021_USB_REQUEST	0x01
 #define SMI2021_USB_INDEX	0x00
@@ -75,6 +100,22 @@
 #define SMI2021_PAL_LINES	576
 #define SMI2021_NTSC_LINES	480
 
+/*
+ * Raw VBI, the blanking lines from the start of each field.
+ * Each line is sampled at 27 MHz, starting this many samples after 0H.
+ */
+#define SMI2021_VBI_SAMPLING_RATE	27000000
+#define SMI2021_NTSC_VBI_LINES		17
+#define SMI2021_NTSC_VBI_START		4
+#define SMI2021_NTSC_VBI_OFFSET		244
+#define SMI2021_PAL_VBI_LINES		22
+#define SMI2021_PAL_VBI_START		1
+#define SMI2021_PAL_VBI_OFFSET		264
+
+/* Sliced VBI services, the caption is on line 21 of both fields */
+#define SMI2021_CC_LINE			21
+#define SMI2021_WSS_LINE		23
+
 /* Timing Referance Codes, see saa7113 datasheet */
 #define SMI2021_TRC_EAV		0x10
 #define SMI2021_TRC_VBI		0x20
@@ -123,6 +164,17 @@ struct smi2021_buf {
 	bool				odd;
 	bool				in_blank;
 	unsigned int			pos;
+
+	/* Start of the first field, from the USB frame counter */
+	u64				ts;
+};
+
+/* Output formats, written by copy_video_block() */
+struct smi2021_fmt {
+	char				*name;
+	u32				fourcc;
+	int				depth;
+	bool				planar;
 };
 
 struct smi2021_vid_input {
@@ -130,6 +182,7 @@ struct smi2021_vid_input {
 	int				type;
 };
 
+/* Number of timing reference header bytes seen so far */
 enum smi2021_sync {
 	HSYNC,
 	SYNCZ1,
@@ -155,19 +208,93 @@ struct gm7113c_init_overrides {
 	bool				r13_adlsb;
 };
 
+/* A transfer buffer, either attached to an urb or waiting in a ring */
+struct smi2021_isoc_buf {
+	struct smi2021			*smi2021;
+	u8				*data;
+	dma_addr_t			dma;
+
+	/* Filled in on completion, for the worker */
+	int				num_packets;
+	unsigned int			actual_length[SMI2021_ISOC_PACKETS_MAX];
+	u64				start_ns;
+	unsigned int			packet_ns;
+	u32				seq;
+};
+
+/* Single producer, single consumer ring, size is a power of two */
+struct smi2021_isoc_ring {
+	struct smi2021_isoc_buf		**bufs;
+	unsigned int			size;
+	unsigned int			head;
+	unsigned int			tail;
+};
+
+/*
+ * Capture statistics. Every counter has a single writer, the urb
+ * completion handler or the worker, and readers don't lock.
+ */
+struct smi2021_stats {
+	/* written by the worker */
+	unsigned long frames_done;
+	unsigned long frames_dropped;
+	unsigned long frames_broken;
+	unsigned long frames_repeated;
+	unsigned long sync_losses;
+	unsigned long bad_packets;
+	unsigned long audio_resyncs;
+	unsigned long audio_rejected;
+	s64 av_offset;		/* ns */
+	u64 bytes;
+
+	/* written by the completion handler */
+	unsigned long urb_errors;
+};
+
 struct smi2021_isoc_ctl {
 	/* max packet size of isoc transaction */
 	int max_pkt_size;
 
-	/* number of allocated urbs */
+	/* number of allocated urbs, and packets per urb */
 	int num_bufs;
+	int num_packets;
 
-	/* urb for isoc transfers */
+	/* urb slots for up to SMI2021_ISOC_TRANSFERS_MAX isoc transfers */
 	struct urb **urb;
 
-	/* transfer buffers for isoc transfer */
-	char **transfer_buffer;
-
+	/* coherent transfer buffers for isoc transfer, two per urb */
+	struct smi2021_isoc_buf *bufs;
+	int buf_size;
+
+	/* urbs in flight, the ones past isoc_target retire on completion */
+	DECLARE_BITMAP(live, SMI2021_ISOC_TRANSFERS_MAX);
+
+	/* spare buffers for the urbs, and buffers waiting to be parsed */
+	struct smi2021_isoc_ring free_ring;
+	struct smi2021_isoc_ring done_ring;
+
+	/* deepest done_ring seen, and transfers dropped for lack of spares */
+	unsigned int ring_high_water;
+	unsigned int ring_overruns;
+
+	/* urbs with missed packets, failed resubmits, and depth changes */
+	unsigned int late_count;
+	unsigned int resubmit_failures;
+	unsigned int resizes;
+
+	/* adaptive mode state, only touched by the worker */
+	unsigned int adapt_events;
+	unsigned int adapt_busy;
+	unsigned int adapt_idle;
+	unsigned int adapt_floor;
+	unsigned long adapt_next;
+
+	/* bus clock recovery, only touched by the completion handler */
+	u32 urb_seq;
+	bool ts_valid;
+	u32 ts_frame;
+	u64 ts_ns;
+	u64 ts_seen;
 };
 
 struct smi2021 {
@@ -191,19 +318,100 @@ struct smi2021 {
 	struct mutex			v4l2_lock;
 	struct mutex			vb_queue_lock;
 
+	/* Raw VBI node, fed by the same parser as the video */
+	struct video_device		vbi_dev;
+	struct vb2_queue		vb_vbiq;
+	struct mutex			vbi_queue_lock;
+
 	struct smi2021_isoc_ctl		isoc_ctl;
+	struct smi2021_stats		stats;
+	struct dentry			*debugfs_dir;
+	struct work_struct		isoc_work;
+	/* Held by isoc_work for each urb it parses */
+	struct mutex			parse_lock;
+	struct work_struct		isoc_resize_work;
+
+	/* Where isoc_work runs in the shared pool, cpu numbers or -1 */
+	int				pool_home;
+	int				pool_hint;
+	int				pool_queued;
+	int				pool_running;
+	bool				streaming;
+	int				stream_users;
+
+	/* isoc settings, from the controls */
+	struct v4l2_ctrl		*isoc_packets_ctrl;
+	int				isoc_transfers;
+	int				isoc_packets;
+	bool				isoc_adaptive;
+	int				isoc_target;
+
+	/* Lines between progress events, 0 is off */
+	int				progress_lines;
+
+	/*
+	 * Capture carries on into the scratch frame while there are no
+	 * buffers, the last complete frame in it can be repeated.
+	 */
+	bool				repeat_frame;
+	struct smi2021_buf		scratch;
+	bool				scratch_full;
+	int				scratch_sequence;
+	enum v4l2_field			scratch_field;
 
 	/* List of videobuf2 buffers protected by a lock. */
 	spinlock_t			buf_lock;
 	struct list_head		avail_bufs;
 	struct smi2021_buf		*cur_buf;
+	struct list_head		avail_vbi_bufs;
+	struct smi2021_buf		*cur_vbi_buf;
+
+	/*
+	 * Buffers are queued before start_streaming sets up the geometry,
+	 * the parser leaves them alone until these are set under parse_lock.
+	 */
+	bool				vid_live;
+	bool				vbi_live;
 
 	int				sequence;
+	int				vbi_sequence;
 
 	/* Frame settings */
 	int				cur_height;
 	v4l2_std_id			cur_norm;
+	enum v4l2_field			cur_field;
+	u32				cur_pixelformat;
+	int				cur_pixel_skip;
+	int				cur_line_skip;
+	struct v4l2_rect		cur_crop;
+
+	/* Capture geometry, set up by start_streaming under parse_lock */
+	unsigned int			sizeimage;
+	int				field_lines;
+	int				crop_top;
+	int				crop_start;
+	int				crop_end;
+	int				width;
+	int				line_step;
+	int				field_offset;
+	unsigned int			luma_size;
+	int				chroma_offset;
+	int				vbi_lines;
+	bool				vbi_sliced;
+	u16				vbi_services;
+
+	/* Parser state */
 	enum smi2021_sync		sync_state;
+	bool				line_locked;
+	int				line_pos;
+	int				field;
+	int				vbi_line;
+	int				vbi_pos;
+	u8				*vbi_dst;
+	u64				packet_ts;
+
+	/* Line being sliced */
+	u8				vbi_slice[SMI2021_BYTES_PER_LINE];
 
 	struct snd_card			*snd_card;
 	struct snd_pcm_substream	*pcm_substream;
@@ -211,7 +419,11 @@ struct smi2021 {
 	unsigned int			pcm_write_ptr;
 	unsigned int			pcm_complete_samples;
 
-	u8				pcm_read_offset;
+	/* Samples since prepare, and the bus time of the last one */
+	u64				pcm_samples;
+	u64				pcm_ts;
+	u64				pcm_start_ns;
+
 	struct work_struct		adev_capture_trigger;
 	atomic_t			adev_capturing;
 
@@ -222,13 +434,6 @@ struct smi2021 {
 
 	int				iso_size;
 
-	bool skip_frame;
-	bool skip_frame_odd;
-
-	int blk_line_start_recheck;
-	int blk_line_read;
-	int to_blk_line_end;
-
 	struct smi2021_chip_type_data_st *chip_type_data;
 };
 
@@ -239,13 +444,20 @@ void smi2021_bootloader_disconnect(struct usb_interface *intf);
 
 /* Provided by smi2021_main.c */
 void smi2021_toggle_audio(struct smi2021 *smi2021, bool enable);
-int smi2021_start(struct smi2021 *smi2021);
-int smi2021_stop(struct smi2021 *smi2021);
+int smi2021_start(struct smi2021 *smi2021, struct vb2_queue *vq);
+int smi2021_stop(struct smi2021 *smi2021, struct vb2_queue *vq);
+void smi2021_log_stats(struct smi2021 *smi2021);
 
 /* Provided by smi2021_v4l2.c */
 int smi2021_vb2_setup(struct smi2021 *smi2021);
 int smi2021_video_register(struct smi2021 *smi2021);
 void smi2021_clear_queue(struct smi2021 *smi2021);
+void smi2021_clear_vbi_queue(struct smi2021 *smi2021);
+void smi2021_reset_crop(struct smi2021 *smi2021);
+
+/* Provided by smi2021_vbi.c */
+bool smi2021_slice_cc(const u8 *p, u8 *data);
+bool smi2021_slice_wss(const u8 *p, u8 *data);
 
 /* Provided by smi2021_audio.c */
 int smi2021_snd_register(struct smi2021 *smi2021);
@@ -29,30 +29,32 @@
  */
 
 #include "smi2021.h"
+#include "smi2021_trace.h"
 
-static void pcm_buffer_free(struct snd_pcm_substream *substream)
-{
-	vfree(substream->runtime->dma_area);
-	substream->runtime->dma_area = NULL;
-	substream->runtime->dma_bytes = 0;
-}
-
-static int pcm_buffer_alloc(struct snd_pcm_substream *substream, int size)
-{
-	if (substream->runtime->dma_area) {
-		if (substream->runtime->dma_bytes > size)
-			return 0;
-		pcm_buffer_free(substream);
-	}
-
-	substream->runtime->dma_area = vmalloc(size);
-	if (substream->runtime->dma_area == NULL)
-		return -ENOMEM;
+/*
+ * The device sends 2 channels of 24 bit samples,
+ * each with a 0x00 header byte in front.
+ */
+#define SMI2021_AUDIO_SAMPLE	4
+
+/* Samples in the audio part of a chunk, rounded up */
+#define SMI2021_AUDIO_MAX	256
+#define SMI2021_AUDIO_LONGS	BITS_TO_LONGS(SMI2021_AUDIO_MAX)
+
+/*
+ * The ring is preallocated when the card is registered and kept over
+ * reopens. Its size can be changed per device through the ALSA prealloc
+ * file in /proc/asound, up to SMI2021_AUDIO_BUFFER_MAX.
+ * It is vmalloc'ed where the managed buffers can do that, older kernels
+ * fall back to physically contiguous pages.
+ */
+#define SMI2021_AUDIO_BUFFER_MAX	(4 * 1024 * 1024)
 
-	substream->runtime->dma_bytes = size;
-
-	return 0;
-}
+static unsigned int audio_buffer_kb = 1024;
+module_param(audio_buffer_kb, uint, 0444);
+MODULE_PARM_DESC(audio_buffer_kb,
+			"Audio ring preallocated for each device, in KiB.\n"
+			"1024 holds 2.7s of S32_LE. Default 1024");
 
 static const struct snd_pcm_hardware smi2021_pcm_hw = {
 	.info = SNDRV_PCM_INFO_BLOCK_TRANSFER |
@@ -61,18 +63,22 @@ static const struct snd_pcm_hardware smi2021_pcm_hw = {
 		SNDRV_PCM_INFO_MMAP_VALID     |
 		SNDRV_PCM_INFO_BATCH,
 
-	.formats = SNDRV_PCM_FMTBIT_S32_LE,
+	/* S32_LE is what the device sends, the others are packed from it */
+	.formats = SNDRV_PCM_FMTBIT_S32_LE |
+		   SNDRV_PCM_FMTBIT_S24_3LE |
+		   SNDRV_PCM_FMTBIT_S16_LE,
 
 	.rates = SNDRV_PCM_RATE_48000,
 	.rate_min = 48000,
 	.rate_max = 48000,
 	.channels_min = 2,
 	.channels_max = 2,
-	.period_bytes_min = 992,	/* 32640 */ /* 15296 */
-	.period_bytes_max = 15872,	/* 65280 */
-	.periods_min = 1,		/* 1 */
-	.periods_max = 16,		/* 2 */
-	.buffer_bytes_max = 65280,	/* 65280 */
+	.period_bytes_min = 992,
+	.period_bytes_max = 65536,
+	.periods_min = 1,
+	.periods_max = 1024,
+	/* Lowered to what is preallocated when opened */
+	.buffer_bytes_max = SMI2021_AUDIO_BUFFER_MAX,
 };
 
 static int smi2021_pcm_open(struct snd_pcm_substream *substream)
@@ -89,6 +95,11 @@ static int smi2021_pcm_open(struct snd_pcm_substream *substream)
 	smi2021->pcm_substream = substream;
 
 	runtime->hw = smi2021_pcm_hw;
+	if (substream->dma_buffer.area)
+		runtime->hw.buffer_bytes_max = substream->dma_buffer.bytes;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	runtime->hw.info |= SNDRV_PCM_INFO_HAS_LINK_ATIME;
+#endif
 	snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
 
 	return 0;
@@ -110,13 +121,14 @@ static int smi2021_pcm_close(struct snd_pcm_substream *substream)
 static int smi2021_pcm_hw_params(struct snd_pcm_substream *substream,
 				struct snd_pcm_hw_params *hw_params)
 {
-	int size, rc;
-	size = params_period_bytes(hw_params) * params_periods(hw_params);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	int rc;
 
-	rc = pcm_buffer_alloc(substream, size);
+	rc = snd_pcm_lib_malloc_pages(substream,
+				params_buffer_bytes(hw_params));
 	if (rc < 0)
 		return rc;
-
+#endif
 
 	return 0;
 }
@@ -130,7 +142,9 @@ static int smi2021_pcm_hw_free(struct snd_pcm_substream *substream)
 		schedule_work(&smi2021->adev_capture_trigger);
 	}
 
-	pcm_buffer_free(substream);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	snd_pcm_lib_free_pages(substream);
+#endif
 	return 0;
 }
 
@@ -139,8 +153,10 @@ static int smi2021_pcm_prepare(struct snd_pcm_substream *substream)
 	struct smi2021 *smi2021 = snd_pcm_substream_chip(substream);
 
 	smi2021->pcm_complete_samples = 0;
-	smi2021->pcm_read_offset = 0;
 	smi2021->pcm_write_ptr = 0;
+	smi2021->pcm_samples = 0;
+	smi2021->pcm_ts = 0;
+	smi2021->pcm_start_ns = 0;
 
 	return 0;
 }
@@ -185,18 +201,68 @@ static snd_pcm_uframes_t smi2021_pcm_pointer(
 				struct snd_pcm_substream *substream)
 {
 	struct smi2021 *smi2021 = snd_pcm_substream_chip(substream);
-	return smi2021->pcm_write_ptr / 8;
+	return bytes_to_frames(substream->runtime, smi2021->pcm_write_ptr);
 }
 
-static struct page *smi2021_pcm_get_vmalloc_page(
-					struct snd_pcm_substream *subs,
-					unsigned long offset)
+/* Time to capture frames at the stream rate, without overflowing */
+static u64 smi2021_audio_ns(struct snd_pcm_runtime *runtime, u64 frames)
 {
-	void *pageptr = subs->runtime->dma_area + offset;
+	u32 rem;
 
-	return vmalloc_to_page(pageptr);
+	frames = div_u64_rem(frames, runtime->rate, &rem);
+	return frames * NSEC_PER_SEC + div_u64((u64)rem * NSEC_PER_SEC,
+						runtime->rate);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+#define smi2021_timespec		timespec
+#define smi2021_ns_to_timespec		ns_to_timespec
+#else
+#define smi2021_timespec		timespec64
+#define smi2021_ns_to_timespec		ns_to_timespec64
+#endif
+
+/* The packet timestamps are good to about a full speed frame */
+#define SMI2021_AUDIO_TS_ACCURACY	NSEC_PER_MSEC
+
+/*
+ * Link time is the count of frames received, system time is when the
+ * packet holding the last of them went over the bus. That is the clock
+ * the video buffers are stamped from, so the two streams can be lined
+ * up directly. It is a monotonic clock, other timestamp types get the
+ * default audio timestamps.
+ */
+static int smi2021_pcm_get_time_info(struct snd_pcm_substream *substream,
+			struct smi2021_timespec *system_ts,
+			struct smi2021_timespec *audio_ts,
+			struct snd_pcm_audio_tstamp_config *audio_tstamp_config,
+			struct snd_pcm_audio_tstamp_report *audio_tstamp_report)
+{
+	struct smi2021 *smi2021 = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	if (audio_tstamp_config->type_requested !=
+			SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK ||
+	    runtime->tstamp_type != SNDRV_PCM_TSTAMP_TYPE_MONOTONIC ||
+	    !smi2021->pcm_ts) {
+		audio_tstamp_report->actual_type =
+				SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
+		return 0;
+	}
+
+	*system_ts = smi2021_ns_to_timespec(smi2021->pcm_ts);
+	*audio_ts = smi2021_ns_to_timespec(smi2021_audio_ns(runtime,
+						smi2021->pcm_samples / 2));
+
+	audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK;
+	audio_tstamp_report->accuracy_report = 1;
+	audio_tstamp_report->accuracy = SMI2021_AUDIO_TS_ACCURACY;
+
+	return 0;
+}
+#endif
+
 static struct snd_pcm_ops smi2021_pcm_ops = {
 	.open = smi2021_pcm_open,
 	.close = smi2021_pcm_close,
@@ -206,7 +272,9 @@ static struct snd_pcm_ops smi2021_pcm_ops = {
 	.prepare = smi2021_pcm_prepare,
 	.trigger = smi2021_pcm_trigger,
 	.pointer = smi2021_pcm_pointer,
-	.page = smi2021_pcm_get_vmalloc_page,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	.get_time_info = smi2021_pcm_get_time_info,
+#endif
 };
 
 int smi2021_snd_register(struct smi2021 *smi2021)
@@ -225,6 +293,18 @@ int smi2021_snd_register(struct smi2021 *smi2021)
 		goto err_free_card;
 
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_CAPTURE, &smi2021_pcm_ops);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+				snd_dma_continuous_data(GFP_KERNEL),
+				min_t(unsigned int, audio_buffer_kb,
+					SMI2021_AUDIO_BUFFER_MAX / 1024) * 1024,
+				SMI2021_AUDIO_BUFFER_MAX);
+#else
+	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_VMALLOC, NULL,
+				min_t(unsigned int, audio_buffer_kb,
+					SMI2021_AUDIO_BUFFER_MAX / 1024) * 1024,
+				SMI2021_AUDIO_BUFFER_MAX);
+#endif
 	pcm->info_flags = 0;
 	pcm->private_data = smi2021;
 	strcpy(pcm->name, "Somagic smi2021 Capture");
@@ -279,17 +359,130 @@ void smi2021_stop_audio(struct smi2021 *smi2021)
 	}
 }
 
-void smi2021_audio(struct smi2021 *smi2021, u8 *data, int len)
+/*
+ * Copy whole samples into the ring at pos and return the new position.
+ * S24_3LE drops the header byte, S16_LE the lowest sample byte as well.
+ */
+static unsigned int smi2021_audio_copy(struct snd_pcm_runtime *runtime,
+				unsigned int pos, unsigned int ring,
+				const u8 *data, int samples)
 {
-	struct snd_pcm_runtime *runtime;
-	u8 offset;
-	int new_offset = 0;
+	u8 *dst = runtime->dma_area;
+	unsigned int cnt;
+
+	switch (runtime->format) {
+	case SNDRV_PCM_FORMAT_S24_3LE:
+		for (; samples > 0; samples--, data += SMI2021_AUDIO_SAMPLE) {
+			memcpy(dst + pos, data + 1, 3);
+			pos += 3;
+			if (pos >= ring)
+				pos = 0;
+		}
+		break;
+	case SNDRV_PCM_FORMAT_S16_LE:
+		for (; samples > 0; samples--, data += SMI2021_AUDIO_SAMPLE) {
+			memcpy(dst + pos, data + 2, 2);
+			pos += 2;
+			if (pos >= ring)
+				pos = 0;
+		}
+		break;
+	default:
+		cnt = samples * SMI2021_AUDIO_SAMPLE;
+		if (pos + cnt >= ring) {
+			memcpy(dst + pos, data, ring - pos);
+			memcpy(dst, data + ring - pos, cnt - (ring - pos));
+			pos = cnt - (ring - pos);
+		} else {
+			memcpy(dst + pos, data, cnt);
+			pos += cnt;
+		}
+		break;
+	}
 
-	int skip;
-	unsigned int stride, oldptr, headptr;
+	return pos;
+}
 
-	int diff = 0;
-	int samples = 0;
+/*
+ * Mark the samples with a good header, one bitmap per byte phase:
+ * bit n of map[p] is set when data[4 * n + p] is 0x00.
+ * Eight bytes are tested at a time, that is two samples in each phase.
+ */
+static void smi2021_audio_headers(const u8 *data, int len,
+			unsigned long map[][SMI2021_AUDIO_LONGS])
+{
+	unsigned long bits;
+	u64 w, z;
+	int i, p, n;
+
+	memset(map, 0, sizeof(map[0]) * SMI2021_AUDIO_SAMPLE);
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		w = get_unaligned_le64(data + i);
+
+		/* Bit 7 of every byte that is 0x00 */
+		z = ~(((w & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) |
+				w | 0x7f7f7f7f7f7f7f7fULL);
+		if (!z)
+			continue;
+
+		n = i / SMI2021_AUDIO_SAMPLE;
+		for (p = 0; p < SMI2021_AUDIO_SAMPLE; p++) {
+			bits = (z >> (8 * p + 7) & 1) |
+				(z >> (8 * p + 39) & 1) << 1;
+			map[p][BIT_WORD(n)] |= bits << (n % BITS_PER_LONG);
+		}
+	}
+
+	for (; i < len; i++)
+		if (!data[i])
+			__set_bit(i / SMI2021_AUDIO_SAMPLE,
+					map[i % SMI2021_AUDIO_SAMPLE]);
+}
+
+/*
+ * Find the first frame, two samples in a row with a good header,
+ * starting at or after byte pos. Returns its byte position or -1.
+ */
+static int smi2021_audio_find(unsigned long frames[][SMI2021_AUDIO_LONGS],
+				int len, int pos)
+{
+	int p, n, from, best = -1;
+
+	for (p = 0; p < SMI2021_AUDIO_SAMPLE && p < len; p++) {
+		n = (len - p) / SMI2021_AUDIO_SAMPLE;
+		from = pos > p ? DIV_ROUND_UP(pos - p, SMI2021_AUDIO_SAMPLE) : 0;
+		if (n < 2 || from >= n - 1)
+			continue;
+
+		from = find_next_bit(frames[p], n - 1, from);
+		if (from >= n - 1)
+			continue;
+
+		from = from * SMI2021_AUDIO_SAMPLE + p;
+		if (best < 0 || from < best)
+			best = from;
+	}
+
+	return best;
+}
+
+/*
+ * Data is the audio part of one chunk. Every sample must start with
+ * its 0x00 header, runs of good samples are copied to the ring and
+ * anything in between is counted as rejected. After a gap the ring
+ * is padded to the next frame, so the channels don't swap.
+ */
+void smi2021_audio(struct smi2021 *smi2021, u8 *data, int len)
+{
+	struct snd_pcm_runtime *runtime;
+	unsigned long map[SMI2021_AUDIO_SAMPLE][SMI2021_AUDIO_LONGS];
+	unsigned long frames[SMI2021_AUDIO_SAMPLE][SMI2021_AUDIO_LONGS];
+	unsigned long flags;
+	unsigned int stride, width, ring, ptr, skip;
+	int pos, start, phase, n, p;
+	int samples = 0, rejected = 0, gaps = 0;
+	u64 audio_ns;
 	bool period_elapsed = false;
 
 
@@ -306,96 +499,88 @@ void smi2021_audio(struct smi2021 *smi2021, u8 *data, int len)
 	if (!runtime || !runtime->dma_area)
 		return;
 
-	offset = smi2021->pcm_read_offset;
 	stride = runtime->frame_bits >> 3;
+	width = stride / 2;
 
 	if (stride == 0)
 		return;
 
-	diff = smi2021->pcm_write_ptr;
+	/* The formats differ in size, wrap where the ring really ends */
+	ring = frames_to_bytes(runtime, runtime->buffer_size);
 
-	/*
-	 * Check that the end of the last buffer was correct.
-	 * If not correct, we mark any partial frames in buffer as complete
-	 */
-	headptr = smi2021->pcm_write_ptr - offset - 4;
-	if (smi2021->pcm_write_ptr > 10
-	    && runtime->dma_area[headptr] != 0x00) {
-		skip = stride - (smi2021->pcm_write_ptr % stride);
-		snd_pcm_stream_lock(smi2021->pcm_substream);
-		smi2021->pcm_write_ptr += skip;
-
-		if (smi2021->pcm_write_ptr >= runtime->dma_bytes)
-			smi2021->pcm_write_ptr -= runtime->dma_bytes;
-
-		snd_pcm_stream_unlock(smi2021->pcm_substream);
-		offset = smi2021->pcm_read_offset = 0;
-	}
-	/*
-	 * The device is actually sending 24Bit pcm data
-	 * with 0x00 as the header byte before each sample.
-	 * We look for this byte to make sure we did not
-	 * loose any bytes during transfer.
-	 */
-	while (len > stride && (data[offset] != 0x00 ||
-			data[offset + (stride / 2)] != 0x00)) {
-		new_offset++;
-		data++;
-		len--;
-	}
+	if (WARN_ON_ONCE(len > SMI2021_AUDIO_MAX * SMI2021_AUDIO_SAMPLE))
+		len = SMI2021_AUDIO_MAX * SMI2021_AUDIO_SAMPLE;
 
-	if (len <= stride) {
-		/* We exhausted the buffer looking for 0x00 */
-		smi2021->pcm_read_offset = 0;
-		return;
+	smi2021_audio_headers(data, len, map);
+	for (p = 0; p < SMI2021_AUDIO_SAMPLE; p++) {
+		bitmap_shift_right(frames[p], map[p], 1, SMI2021_AUDIO_MAX);
+		bitmap_and(frames[p], frames[p], map[p], SMI2021_AUDIO_MAX);
 	}
-	if (new_offset != 0) {
-		/*
-		 * This buffer can not be appended to the current buffer,
-		 * so we mark any partial frames in the buffer as complete.
-		 */
-		skip = stride - (smi2021->pcm_write_ptr % stride);
-		snd_pcm_stream_lock(smi2021->pcm_substream);
-		smi2021->pcm_write_ptr += skip;
 
-		if (smi2021->pcm_write_ptr >= runtime->dma_bytes)
-			smi2021->pcm_write_ptr -= runtime->dma_bytes;
-
-		snd_pcm_stream_unlock(smi2021->pcm_substream);
+	ptr = smi2021->pcm_write_ptr;
+	pos = 0;
+	for (;;) {
+		start = smi2021_audio_find(frames, len, pos);
+		if (start < 0)
+			start = len;
+
+		/* Whatever doesn't fit in a sample at the end isn't a gap */
+		if (start - pos >= SMI2021_AUDIO_SAMPLE ||
+		    (start > pos && start < len)) {
+			rejected += DIV_ROUND_UP(start - pos,
+						SMI2021_AUDIO_SAMPLE);
+			gaps++;
+
+			skip = (stride - ptr % stride) % stride;
+			ptr += skip;
+			if (ptr >= ring)
+				ptr -= ring;
+			samples += skip / width;
+		}
 
-		offset = smi2021->pcm_read_offset = new_offset % (stride / 2);
+		if (start == len)
+			break;
 
-	}
+		phase = start % SMI2021_AUDIO_SAMPLE;
+		n = start / SMI2021_AUDIO_SAMPLE;
+		n = find_next_zero_bit(map[phase],
+				(len - phase) / SMI2021_AUDIO_SAMPLE, n) - n;
 
-	oldptr = smi2021->pcm_write_ptr;
-	if (oldptr + len >= runtime->dma_bytes) {
-		unsigned int cnt = runtime->dma_bytes - oldptr;
-		memcpy(runtime->dma_area + oldptr, data, cnt);
-		memcpy(runtime->dma_area, data + cnt, len - cnt);
-	} else {
-		memcpy(runtime->dma_area + oldptr, data, len);
+		ptr = smi2021_audio_copy(runtime, ptr, ring, data + start, n);
+		samples += n;
+		pos = start + n * SMI2021_AUDIO_SAMPLE;
 	}
 
-	snd_pcm_stream_lock(smi2021->pcm_substream);
-	smi2021->pcm_write_ptr += len;
-
-	if (smi2021->pcm_write_ptr >= runtime->dma_bytes)
-		smi2021->pcm_write_ptr -= runtime->dma_bytes;
-
-	samples = smi2021->pcm_write_ptr - diff;
-	if (samples < 0)
-		samples += runtime->dma_bytes;
+	smi2021->stats.audio_resyncs += gaps;
+	smi2021->stats.audio_rejected += rejected;
 
-	samples /= (stride / 2);
+	if (!samples)
+		return;
 
+	snd_pcm_stream_lock_irqsave(smi2021->pcm_substream, flags);
+	smi2021->pcm_write_ptr = ptr;
+	smi2021->pcm_samples += samples;
+	smi2021->pcm_ts = smi2021->packet_ts;
 	smi2021->pcm_complete_samples += samples;
 	if (smi2021->pcm_complete_samples / 2 >= runtime->period_size) {
 		smi2021->pcm_complete_samples -= runtime->period_size * 2;
 		period_elapsed = true;
 	}
-	snd_pcm_stream_unlock(smi2021->pcm_substream);
+	snd_pcm_stream_unlock_irqrestore(smi2021->pcm_substream, flags);
 
-	if (period_elapsed)
+	/*
+	 * How far the audio has come off the video clock since the start,
+	 * positive when the frames arrive later than their count says.
+	 */
+	audio_ns = smi2021_audio_ns(runtime, smi2021->pcm_samples / 2);
+	if (!smi2021->pcm_start_ns)
+		smi2021->pcm_start_ns = smi2021->packet_ts - audio_ns;
+	smi2021->stats.av_offset = smi2021->packet_ts -
+					smi2021->pcm_start_ns - audio_ns;
+
+	if (period_elapsed) {
+		trace_smi2021_audio_period(smi2021->pcm_write_ptr);
 		snd_pcm_period_elapsed(smi2021->pcm_substream);
+	}
 
 }
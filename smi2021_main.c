@@ -30,6 +30,9 @@
 
 #include "smi2021.h"
 
+#define CREATE_TRACE_POINTS
+#include "smi2021_trace.h"
+
 #if !defined(CONFIG_VIDEOBUF2_VMALLOC) && !defined(CONFIG_VIDEOBUF2_VMALLOC_MODULE)
 	#error  Unable find required dependency: CONFIG_VIDEOBUF2_VMALLOC in you kernel .config
 #endif
@@ -373,17 +376,15 @@ static int smi2021_initialize(struct smi2021 *smi2021)
 	return 0;
 }
 
-static struct smi2021_buf *smi2021_get_buf(struct smi2021 *smi2021)
+static struct smi2021_buf *smi2021_get_buf(struct smi2021 *smi2021,
+						struct list_head *bufs)
 {
 	unsigned long flags;
 	struct smi2021_buf *buf = NULL;
 
-	WARN_ON(smi2021->cur_buf);
-
 	spin_lock_irqsave(&smi2021->buf_lock, flags);
-	if (!list_empty(&smi2021->avail_bufs)) {
-		buf = list_first_entry(&smi2021->avail_bufs,
-						struct smi2021_buf, list);
+	if (!list_empty(bufs)) {
+		buf = list_first_entry(bufs, struct smi2021_buf, list);
 		list_del(&buf->list);
 	}
 	spin_unlock_irqrestore(&smi2021->buf_lock, flags);
@@ -391,23 +392,90 @@ static struct smi2021_buf *smi2021_get_buf(struct smi2021 *smi2021)
 	return buf;
 }
 
+/* Is the field we are receiving the last one going into this buffer? */
+static bool smi2021_last_field(struct smi2021 *smi2021,
+				struct smi2021_buf *buf)
+{
+	switch (smi2021->cur_field) {
+	case V4L2_FIELD_ALTERNATE:
+	case V4L2_FIELD_TOP:
+	case V4L2_FIELD_BOTTOM:
+		return true;
+	case V4L2_FIELD_INTERLACED:
+	case V4L2_FIELD_SEQ_TB:
+	default:
+		return buf->odd;
+	}
+}
+
+/*
+ * Can a new buffer be started with this field?
+ * In the single field modes the other field is never copied at all.
+ */
+static bool smi2021_first_field(struct smi2021 *smi2021, bool field2)
+{
+	switch (smi2021->cur_field) {
+	case V4L2_FIELD_ALTERNATE:
+		return true;
+	case V4L2_FIELD_BOTTOM:
+		return field2;
+	case V4L2_FIELD_TOP:
+	case V4L2_FIELD_INTERLACED:
+	case V4L2_FIELD_SEQ_TB:
+	default:
+		return !field2;
+	}
+}
+
 static void smi2021_buf_done(struct smi2021 *smi2021)
 {
 	struct smi2021_buf *buf = smi2021->cur_buf;
+	enum v4l2_field field = smi2021->cur_field;
+	int sequence = smi2021->sequence;
+	bool error = buf->pos < SMI2021_BYTES_PER_LINE * smi2021->field_lines;
+	unsigned int index;
+
+	/* Both fields of a frame share the sequence number */
+	if (field == V4L2_FIELD_ALTERNATE) {
+		field = buf->odd ? V4L2_FIELD_BOTTOM : V4L2_FIELD_TOP;
+		if (buf->odd)
+			smi2021->sequence++;
+	} else {
+		smi2021->sequence++;
+	}
+
+	/* Nobody to give it to, keep it in case it is repeated */
+	if (buf == &smi2021->scratch) {
+		smi2021->scratch_full = !error;
+		smi2021->scratch_sequence = sequence;
+		smi2021->scratch_field = field;
+		if (smi2021->cur_field != V4L2_FIELD_ALTERNATE || buf->odd)
+			smi2021->stats.frames_dropped++;
+		smi2021->cur_buf = NULL;
+		return;
+	}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-	v4l2_get_timestamp(&buf->vb.v4l2_buf.timestamp);
-	buf->vb.v4l2_buf.sequence = smi2021->sequence++;
-	buf->vb.v4l2_buf.field = V4L2_FIELD_INTERLACED;
+	buf->vb.v4l2_buf.timestamp = ns_to_timeval(buf->ts);
+	buf->vb.v4l2_buf.sequence = sequence;
+	buf->vb.v4l2_buf.field = field;
 #elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
-	v4l2_get_timestamp(&buf->vb.timestamp);
-	buf->vb.sequence = smi2021->sequence++;
-	buf->vb.field = V4L2_FIELD_INTERLACED;
+	buf->vb.timestamp = ns_to_timeval(buf->ts);
+	buf->vb.sequence = sequence;
+	buf->vb.field = field;
 #elif  LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-	buf->vb.vb2_buf.timestamp = ktime_get_ns();
-	buf->vb.sequence = smi2021->sequence++;
-	buf->vb.field = V4L2_FIELD_INTERLACED;
+	buf->vb.vb2_buf.timestamp = buf->ts;
+	buf->vb.sequence = sequence;
+	buf->vb.field = field;
 #endif
-	if (buf->pos < (SMI2021_BYTES_PER_LINE * (smi2021->cur_height/2))) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	index = buf->vb.v4l2_buf.index;
+#else
+	index = buf->vb.vb2_buf.index;
+#endif
+	trace_smi2021_buf_done(index, sequence, buf->ts, error);
+
+	if (error) {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 		vb2_set_plane_payload(&buf->vb, 0, 0);
 		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
@@ -415,15 +483,17 @@ static void smi2021_buf_done(struct smi2021 *smi2021)
 		vb2_set_plane_payload(&buf->vb.vb2_buf, 0, 0);
 		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_ERROR);
 #endif
+		smi2021->stats.frames_broken++;
 	} else {
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
-		vb2_set_plane_payload(&buf->vb, 0, buf->pos * 2);
+		vb2_set_plane_payload(&buf->vb, 0, smi2021->sizeimage);
 		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
 #else
-		vb2_set_plane_payload(&buf->vb.vb2_buf, 0, buf->pos * 2);
+		vb2_set_plane_payload(&buf->vb.vb2_buf, 0, smi2021->sizeimage);
 		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
 #endif
+		smi2021->stats.frames_done++;
 	}
 
 	smi2021->cur_buf = NULL;
@@ -439,159 +509,588 @@ static void smi2021_buf_done(struct smi2021 *smi2021)
 	((trc & SMI2021_TRC_FIELD_2) == 0x00)
 
 /*
- * Parse the TRC.
- * Grab a new buffer from the queue if don't have one
- * and we are recieving the start of a video frame.
- *
- * Mark video buffers as done if we have one full frame.
+ * Userspace ran out of buffers and has queued one again. Fill it with
+ * the last frame captured into the scratch frame meanwhile, rather than
+ * having it wait for the next frame to arrive.
  */
-static void parse_trc(struct smi2021 *smi2021, u8 trc)
+static void smi2021_repeat_frame(struct smi2021 *smi2021,
+				struct smi2021_buf *buf)
 {
-	struct smi2021_buf *buf = smi2021->cur_buf;
-	int max_line_num_per_field = (smi2021->cur_height / 2) - 1;
-	int line = 0;
+	struct smi2021_event_repeat *repeat;
+	struct v4l2_event ev = {
+		.type = SMI2021_EVENT_REPEAT,
+	};
 
-	if (!buf) {
-		if (!smi2021->skip_frame) {
-			// get_buf makes sense only in begin field1, otherwise frame will be incomplete and we skip it
-			if (is_sav(trc) && is_active_video(trc) && is_field1(trc)) {
-				buf = smi2021_get_buf(smi2021);
-				if (!buf) {
-					smi2021->skip_frame = true;
-					return;
-				} else {
-					smi2021->cur_buf = buf;
-				}
-			} else {
-				return;
-			}
-		}
-	}
+	memcpy(buf->mem, smi2021->scratch.mem, smi2021->sizeimage);
 
-	if (is_sav(trc)) {
-		/* Start of VBI or ACTIVE VIDEO */
-		if (buf) {
-			if (is_active_video(trc)) {
-				buf->in_blank = false;
-			} else {
-				/* VBI */
-				buf->in_blank = true;
-			}
-		}
-		if (!smi2021->skip_frame) {
-			if (!buf->odd && is_field2(trc)) {
-				line = (buf->pos / SMI2021_BYTES_PER_LINE) - 1;
-				if (line < max_line_num_per_field) {
-					dev_info(smi2021->dev, "Skip broken frame: %d line, but need %d in current %d height", line + 1, max_line_num_per_field + 1, smi2021->cur_height);
-					goto buf_done;
-				}
-				buf->odd = true;
-				buf->pos = 0;
-			}
-			if (buf->odd && !is_field2(trc)) {
-				goto buf_done;
-			}
+	repeat = (struct smi2021_event_repeat *)ev.u.data;
+	repeat->sequence = smi2021->scratch_sequence;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	buf->vb.v4l2_buf.timestamp = ns_to_timeval(smi2021->scratch.ts);
+	buf->vb.v4l2_buf.sequence = smi2021->scratch_sequence;
+	buf->vb.v4l2_buf.field = smi2021->scratch_field;
+	repeat->index = buf->vb.v4l2_buf.index;
+	v4l2_event_queue(&smi2021->vdev, &ev);
+	vb2_set_plane_payload(&buf->vb, 0, smi2021->sizeimage);
+	vb2_buffer_done(&buf->vb, VB2_BUF_STATE_DONE);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	buf->vb.timestamp = ns_to_timeval(smi2021->scratch.ts);
+	buf->vb.sequence = smi2021->scratch_sequence;
+	buf->vb.field = smi2021->scratch_field;
+	repeat->index = buf->vb.vb2_buf.index;
+	v4l2_event_queue(&smi2021->vdev, &ev);
+	vb2_set_plane_payload(&buf->vb.vb2_buf, 0, smi2021->sizeimage);
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+#else
+	buf->vb.vb2_buf.timestamp = smi2021->scratch.ts;
+	buf->vb.sequence = smi2021->scratch_sequence;
+	buf->vb.field = smi2021->scratch_field;
+	repeat->index = buf->vb.vb2_buf.index;
+	v4l2_event_queue(&smi2021->vdev, &ev);
+	vb2_set_plane_payload(&buf->vb.vb2_buf, 0, smi2021->sizeimage);
+	vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_DONE);
+#endif
+
+	/* It was counted as dropped when it went to the scratch frame */
+	if (smi2021->cur_field != V4L2_FIELD_ALTERNATE ||
+	    smi2021->scratch_field == V4L2_FIELD_BOTTOM)
+		smi2021->stats.frames_dropped--;
+	smi2021->stats.frames_repeated++;
+}
+
+/*
+ * A new field begins.
+ * Finish the field we were capturing, and either carry on with the
+ * next field in the same buffer, or grab a new buffer if the new field
+ * can start one. Buffers are only started at the beginning of a field,
+ * so we never deliver a buffer that started half way through a field.
+ */
+static void smi2021_field_start(struct smi2021 *smi2021, bool field2)
+{
+	struct smi2021_buf *buf = smi2021->cur_buf;
+	int lines;
+
+	trace_smi2021_field_start(smi2021->sequence, field2);
+
+	if (buf) {
+		lines = buf->pos / SMI2021_BYTES_PER_LINE;
+		if (lines < smi2021->field_lines) {
+			dev_info(smi2021->dev, "Skip broken frame: %d line, but need %d in current %d height",
+				lines, smi2021->field_lines,
+				smi2021->cur_height);
+			smi2021_buf_done(smi2021);
+		} else if (smi2021_last_field(smi2021, buf)) {
+			smi2021_buf_done(smi2021);
 		} else {
-			if (!smi2021->skip_frame_odd && is_field2(trc)) {
-				smi2021->skip_frame_odd = true;
-			}
-			if (smi2021->skip_frame_odd && !is_field2(trc)) {
-				goto buf_done;
-			}
+			buf->odd = field2;
+			buf->pos = 0;
+			return;
 		}
-	} else {
-		/* End of VBI or ACTIVE VIDEO */
-		if (buf) {
-			buf->in_blank = true;
+	}
+
+	if (!smi2021_first_field(smi2021, field2))
+		return;
+
+	WARN_ON(smi2021->cur_buf);
+
+	buf = NULL;
+	if (smi2021->vid_live)
+		buf = smi2021_get_buf(smi2021, &smi2021->avail_bufs);
+	if (buf && smi2021->scratch_full && READ_ONCE(smi2021->repeat_frame)) {
+		smi2021_repeat_frame(smi2021, buf);
+		buf = smi2021_get_buf(smi2021, &smi2021->avail_bufs);
+	}
+
+	/* Anything in the scratch frame is older than what comes next */
+	smi2021->scratch_full = false;
+
+	if (!buf && smi2021->scratch.mem) {
+		/* Keep capturing, so nothing depends on userspace keeping up */
+		buf = &smi2021->scratch;
+	} else if (!buf) {
+		/* Dropped, but still counted */
+		if (smi2021->cur_field != V4L2_FIELD_ALTERNATE || field2) {
+			smi2021->sequence++;
+			smi2021->stats.frames_dropped++;
 		}
+		return;
 	}
 
-	return;
+	buf->odd = field2;
+	buf->pos = 0;
+	buf->ts = smi2021->packet_ts;
+	smi2021->cur_buf = buf;
+}
 
-buf_done:
-	if (!smi2021->skip_frame)
-		smi2021_buf_done(smi2021);
-	smi2021->skip_frame = false;
-	smi2021->skip_frame_odd = false;
+/* Clear the raw lines of this field the decoder didn't send us */
+static void smi2021_vbi_clear(struct smi2021 *smi2021,
+				struct smi2021_buf *buf)
+{
+	int line = smi2021->vbi_line;
+
+	if (smi2021->vbi_sliced || line >= smi2021->vbi_lines)
+		return;
+
+	if (buf->odd)
+		line += smi2021->vbi_lines;
+
+	memset(buf->mem + line * SMI2021_BYTES_PER_LINE, 0,
+		(smi2021->vbi_lines - smi2021->vbi_line) *
+		SMI2021_BYTES_PER_LINE);
+	smi2021->vbi_line = smi2021->vbi_lines;
 }
 
-static void copy_video_block(struct smi2021 *smi2021, u8 *p, int size)
+static void smi2021_vbi_buf_done(struct smi2021 *smi2021,
+				enum vb2_buffer_state state)
 {
-	struct smi2021_buf *buf = smi2021->cur_buf;
+	struct smi2021_buf *buf = smi2021->cur_vbi_buf;
+	unsigned int size = 2 * smi2021->vbi_lines * SMI2021_BYTES_PER_LINE;
 
-	int line = 0;
-	int pos_in_line = 0;
-	unsigned int offset = 0;
-	u8 *dst;
-	int byte_copied = 0;
-	int can_buf_done = 0;
+	smi2021_vbi_clear(smi2021, buf);
+	if (smi2021->vbi_sliced)
+		size = buf->pos;
 
-	mm_segment_t old_fs;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	buf->vb.v4l2_buf.timestamp = ns_to_timeval(buf->ts);
+	buf->vb.v4l2_buf.sequence = smi2021->vbi_sequence++;
+	buf->vb.v4l2_buf.field = V4L2_FIELD_NONE;
+	vb2_set_plane_payload(&buf->vb, 0, size);
+	vb2_buffer_done(&buf->vb, state);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+	buf->vb.timestamp = ns_to_timeval(buf->ts);
+	buf->vb.sequence = smi2021->vbi_sequence++;
+	buf->vb.field = V4L2_FIELD_NONE;
+	vb2_set_plane_payload(&buf->vb.vb2_buf, 0, size);
+	vb2_buffer_done(&buf->vb.vb2_buf, state);
+#else
+	buf->vb.vb2_buf.timestamp = buf->ts;
+	buf->vb.sequence = smi2021->vbi_sequence++;
+	buf->vb.field = V4L2_FIELD_NONE;
+	vb2_set_plane_payload(&buf->vb.vb2_buf, 0, size);
+	vb2_buffer_done(&buf->vb.vb2_buf, state);
+#endif
+
+	smi2021->cur_vbi_buf = NULL;
+}
+
+/*
+ * The VBI buffer holds the lines from the start of field 1 followed by
+ * those of field 2, or the data sliced from them, so it is started by
+ * field 1 and continued by field 2.
+ */
+static void smi2021_vbi_field_start(struct smi2021 *smi2021, bool field2)
+{
+	struct smi2021_buf *buf = smi2021->cur_vbi_buf;
+
+	if (buf && field2) {
+		smi2021_vbi_clear(smi2021, buf);
+		buf->odd = true;
+	}
 
-	int start_corr, len_copy;
-	start_corr = 0;
-	len_copy = size;
+	smi2021->vbi_line = 0;
+	smi2021->vbi_pos = -1;
 
-	if (smi2021->skip_frame)
+	if (field2)
 		return;
 
+	/* We never saw the end of the VBI lines in field 2 */
+	if (buf)
+		smi2021_vbi_buf_done(smi2021, VB2_BUF_STATE_ERROR);
+
+	buf = NULL;
+	if (smi2021->vbi_live)
+		buf = smi2021_get_buf(smi2021, &smi2021->avail_vbi_bufs);
 	if (!buf) {
+		smi2021->vbi_sequence++;
 		return;
 	}
 
-	if (buf->in_blank) {
+	buf->odd = false;
+	buf->pos = 0;
+	buf->ts = smi2021->packet_ts;
+	smi2021->cur_vbi_buf = buf;
+}
+
+/*
+ * The sliced service carried by a line, counted from the start of the
+ * field, and its line number as the sliced VBI API numbers them.
+ * Field 1 starts at SMI2021_*_VBI_START, field 2 one line later in the
+ * frame for 525 lines, so the caption is one line further into it.
+ */
+static u32 smi2021_vbi_service(struct smi2021 *smi2021, bool field2,
+				int line, u32 *number)
+{
+	u16 services = smi2021->vbi_services;
+
+	if ((services & V4L2_SLICED_CAPTION_525) &&
+	    line == SMI2021_CC_LINE - SMI2021_NTSC_VBI_START + field2) {
+		*number = SMI2021_CC_LINE;
+		return V4L2_SLICED_CAPTION_525;
+	}
+
+	if ((services & V4L2_SLICED_WSS_625) && !field2 &&
+	    line == SMI2021_WSS_LINE - SMI2021_PAL_VBI_START) {
+		*number = SMI2021_WSS_LINE;
+		return V4L2_SLICED_WSS_625;
+	}
+
+	return 0;
+}
+
+/* A whole line to slice has been copied to vbi_slice */
+static void smi2021_vbi_slice(struct smi2021 *smi2021)
+{
+	struct smi2021_buf *buf = smi2021->cur_vbi_buf;
+	struct v4l2_sliced_vbi_data *sliced;
+	u32 id, number;
+	bool found;
+
+	if (buf->pos + sizeof(*sliced) > buf->length)
+		return;
+
+	id = smi2021_vbi_service(smi2021, buf->odd, smi2021->vbi_line - 1,
+				&number);
+	sliced = buf->mem + buf->pos;
+	memset(sliced, 0, sizeof(*sliced));
+
+	if (id == V4L2_SLICED_CAPTION_525)
+		found = smi2021_slice_cc(smi2021->vbi_slice, sliced->data);
+	else
+		found = smi2021_slice_wss(smi2021->vbi_slice, sliced->data);
+
+	if (!found)
+		return;
+
+	sliced->id = id;
+	sliced->field = buf->odd;
+	sliced->line = number;
+	buf->pos += sizeof(*sliced);
+}
+
+/*
+ * Every SAV starts the next line of the field, and the first
+ * vbi_lines of them go to the VBI buffer, either as they are
+ * or through the slicer. Any other TRC ends the line.
+ * The buffer is handed over once all the lines of field 2 are in.
+ */
+static void smi2021_vbi_trc(struct smi2021 *smi2021, u8 trc)
+{
+	struct smi2021_buf *buf = smi2021->cur_vbi_buf;
+	u32 number;
+	int line;
+
+	smi2021->vbi_pos = -1;
+	if (!buf || !is_sav(trc) ||
+	    smi2021->vbi_line > smi2021->vbi_lines)
+		return;
+
+	line = smi2021->vbi_line++;
+	if (line == smi2021->vbi_lines) {
+		if (buf->odd)
+			smi2021_vbi_buf_done(smi2021, VB2_BUF_STATE_DONE);
 		return;
 	}
 
-	pos_in_line = buf->pos % SMI2021_BYTES_PER_LINE;
-	line = buf->pos / SMI2021_BYTES_PER_LINE;
+	if (smi2021->vbi_sliced) {
+		if (!smi2021_vbi_service(smi2021, buf->odd, line, &number))
+			return;
+		smi2021->vbi_dst = smi2021->vbi_slice;
+	} else {
+		if (buf->odd)
+			line += smi2021->vbi_lines;
+		smi2021->vbi_dst = buf->mem + line * SMI2021_BYTES_PER_LINE;
+	}
 
-	if (buf->odd) {
-		offset += SMI2021_BYTES_PER_LINE;
+	smi2021->vbi_pos = 0;
+}
+
+/*
+ * Parse the TRC.
+ * A change of the field bit in a SAV starts a new field,
+ * the rest of the TRCs only tell us when we are in the blanking.
+ */
+static void parse_trc(struct smi2021 *smi2021, u8 trc)
+{
+	trace_smi2021_trc(trc);
+
+	if (is_sav(trc) && smi2021->field != is_field2(trc)) {
+		/* We don't know where the first field we see started */
+		if (smi2021->field >= 0) {
+			smi2021_field_start(smi2021, is_field2(trc));
+			smi2021_vbi_field_start(smi2021, is_field2(trc));
+		}
+		smi2021->field = is_field2(trc);
 	}
 
-	offset += (SMI2021_BYTES_PER_LINE * line * 2) + pos_in_line;
+	if (smi2021->cur_buf)
+		smi2021->cur_buf->in_blank = !is_sav(trc) ||
+					     !is_active_video(trc);
 
-	if (offset >= buf->length) {
-		len_copy = 0;
-		can_buf_done = 1;
+	smi2021_vbi_trc(smi2021, trc);
+}
+
+/*
+ * Tell userspace how much of the buffer being filled is usable.
+ * Only lines that are valid all the way from the top are counted,
+ * so woven frames make no progress until the second field arrives.
+ */
+static void smi2021_progress(struct smi2021 *smi2021,
+				struct smi2021_buf *buf)
+{
+	struct smi2021_event_progress *progress;
+	struct v4l2_event ev = {
+		.type = SMI2021_EVENT_PROGRESS,
+	};
+	int lines = buf->pos / SMI2021_BYTES_PER_LINE - smi2021->crop_top;
+
+	if (lines <= 0)
+		return;
+
+	lines = DIV_ROUND_UP(lines, smi2021->cur_line_skip);
+
+	if (smi2021->line_step > 1)
+		lines = buf->odd ? lines * smi2021->line_step : 0;
+	else if (buf->odd)
+		lines += smi2021->field_offset;
+
+	if (!lines)
+		return;
+
+	progress = (struct smi2021_event_progress *)ev.u.data;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	progress->index = buf->vb.v4l2_buf.index;
+#else
+	progress->index = buf->vb.vb2_buf.index;
+#endif
+	progress->sequence = smi2021->sequence;
+	progress->lines = lines;
+	progress->field = buf->odd ? V4L2_FIELD_BOTTOM : V4L2_FIELD_TOP;
+
+	v4l2_event_queue(&smi2021->vdev, &ev);
+}
+
+/*
+ * Write part of a UYVY line from the device to the buffer in the
+ * current pixel format. x is the offset into the UYVY line after
+ * decimation, line the line in the buffer and field_line the line
+ * within the field.
+ */
+static void smi2021_copy_line(struct smi2021 *smi2021,
+				struct smi2021_buf *buf, int field_line,
+				int line, int x, const u8 *p, int len)
+{
+	const int width = smi2021->width;
+	bool blend = false;
+	int chroma_line;
+	u8 *y, *uv;
+	int i;
+
+	switch (smi2021->cur_pixelformat) {
+	case V4L2_PIX_FMT_YUYV:
+		y = buf->mem + line * width * 2;
+		for (i = 0; i < len; i++)
+			y[(x + i) ^ 1] = p[i];
+		return;
+	case V4L2_PIX_FMT_GREY:
+		/* Only the Y bytes, the odd ones */
+		y = buf->mem + line * width;
+		for (i = !(x & 1); i < len; i += 2)
+			y[(x + i) / 2] = p[i];
+		return;
+	case V4L2_PIX_FMT_NV16:
+		uv = buf->mem + smi2021->luma_size + line * width;
+		break;
+	case V4L2_PIX_FMT_NV12:
+		/*
+		 * Subsample the chroma within the field, so the two
+		 * fields of a frame never get mixed. The second line of
+		 * each pair is averaged into the chroma of the first.
+		 */
+		chroma_line = field_line / 2 * smi2021->line_step;
+		if (buf->odd)
+			chroma_line += smi2021->chroma_offset;
+		uv = buf->mem + smi2021->luma_size + chroma_line * width;
+		blend = field_line & 1;
+		break;
+	case V4L2_PIX_FMT_UYVY:
+	default:
+		memcpy(buf->mem + line * width * 2 + x, p, len);
+		return;
 	}
 
-	if ( len_copy > 0 ) {
-		dst = buf->mem + offset;
-		if (offset + len_copy >= buf->length) {
-			len_copy = buf->length - offset;
-			can_buf_done = 1;
-		}
+	y = buf->mem + line * width;
+	for (i = 0; i < len; i++, x++) {
+		if (x & 1)
+			y[x / 2] = p[i];
+		else if (blend)
+			uv[x / 2] = (uv[x / 2] + p[i] + 1) / 2;
+		else
+			uv[x / 2] = p[i];
+	}
+}
 
-		// Issue 12.
-		// Bug in use copy_to_user: sometime size, returned by user_addr_max() is smaller, then already exist pointer to buf from and to - because we
-		// in USER_DS segment.
-		// As result copy_to_user -> access_ok -> user_addr_max == return false and we unable copy data to user space.
-		// In future we can use simple:
-		//  memcpy(dst, p, len_copy);
-		// Because user_addr_max typically eq (~0UL)
-		//
-		// If anybody know more proper way - welcom.
-
-		if (segment_eq(get_fs(), USER_DS)) {
-			//printk_ratelimited(KERN_INFO "smi2021: WARNING !!! Issue 12. We on USER_DS segment. line=%d, buf->pos=%d, len_copy=%d", line, buf->pos, len_copy);
-			old_fs = get_fs();
-			set_fs(KERNEL_DS);
-			byte_copied = copy_to_user((unsigned long *)dst, (unsigned long *)p, (unsigned long )len_copy);
-			set_fs(old_fs);
+/*
+ * Horizontal decimation, keep the first UYVY pixel pair out of every
+ * cur_pixel_skip pairs. x is the offset into the cropped line.
+ */
+static void smi2021_copy_decimated(struct smi2021 *smi2021,
+				struct smi2021_buf *buf, int field_line,
+				int line, int x, const u8 *p, int len)
+{
+	const int group = 4 * smi2021->cur_pixel_skip;
+	int offset, n;
+
+	while (len > 0) {
+		offset = x % group;
+		if (offset < 4) {
+			n = min(len, 4 - offset);
+			smi2021_copy_line(smi2021, buf, field_line, line,
+					x / group * 4 + offset, p, n);
 		} else {
-			byte_copied = copy_to_user((unsigned long *)dst, (unsigned long *)p, (unsigned long )len_copy);
+			n = min(len, group - offset);
 		}
-		if (byte_copied) {
-			dev_warn(smi2021->dev, " Failed copy_to_user: USER_DS=%d len_copy=%d, not_copied=%d, line=%d, odd=%d, buf->pos=%d, offset=%d, buf->length=%d FROM=%lu, TO=%lu", segment_eq(get_fs(), USER_DS), len_copy, byte_copied, line, buf->odd, buf->pos, offset, buf->length,  (long unsigned int )p, (long unsigned int )dst);
-		}
-		buf->pos = buf->pos + len_copy;
+		x += n;
+		p += n;
+		len -= n;
 	}
+}
+
+static void copy_video_block(struct smi2021 *smi2021, const u8 *p, int size)
+{
+	struct smi2021_buf *buf = smi2021->cur_buf;
+	unsigned int field_size, start, step;
+	int field_line, line, pos_in_line, len, x, end;
 
-	if (can_buf_done && buf->odd) {
+	if (!buf || buf->in_blank)
+		return;
+
+	/*
+	 * Copy line by line, lines past the end of the field are dropped,
+	 * as is everything outside the crop rectangle.
+	 * buf->mem is the kernel mapping of the vb2 plane for every memory
+	 * model the vmalloc allocator offers. MMAP buffers are vmalloc'ed,
+	 * USERPTR pages are pinned and mapped with vm_map_ram() and DMABUF
+	 * attachments are vmap'ed when the buffer is queued, so we can
+	 * write the pixel format straight into it.
+	 */
+	field_size = SMI2021_BYTES_PER_LINE * smi2021->field_lines;
+	start = buf->pos;
+	while (size > 0 && buf->pos < field_size) {
+		field_line = buf->pos / SMI2021_BYTES_PER_LINE -
+							smi2021->crop_top;
+		pos_in_line = buf->pos % SMI2021_BYTES_PER_LINE;
+		len = min(size, SMI2021_BYTES_PER_LINE - pos_in_line);
+
+		/* Vertical decimation drops all but every cur_line_skip line */
+		if (field_line < 0 || field_line % smi2021->cur_line_skip)
+			goto next;
+
+		x = max_t(int, pos_in_line, smi2021->crop_start);
+		end = min_t(int, pos_in_line + len, smi2021->crop_end);
+		if (x >= end)
+			goto next;
+
+		field_line /= smi2021->cur_line_skip;
+		line = field_line * smi2021->line_step;
+		if (buf->odd)
+			line += smi2021->field_offset;
+
+		if (smi2021->cur_pixel_skip > 1)
+			smi2021_copy_decimated(smi2021, buf, field_line, line,
+					x - smi2021->crop_start,
+					p + x - pos_in_line, end - x);
+		else
+			smi2021_copy_line(smi2021, buf, field_line, line,
+					x - smi2021->crop_start,
+					p + x - pos_in_line, end - x);
+next:
+		buf->pos += len;
+		p += len;
+		size -= len;
+	}
+
+	if (start < field_size && buf->pos >= field_size)
+		trace_smi2021_field_end(smi2021->sequence, buf->odd);
+
+	/* Don't wait for the next field to hand over a complete buffer */
+	if (buf->pos >= field_size && smi2021_last_field(smi2021, buf)) {
 		smi2021_buf_done(smi2021);
+		return;
+	}
+
+	step = SMI2021_BYTES_PER_LINE * READ_ONCE(smi2021->progress_lines);
+	if (step && buf->pos / step != start / step &&
+	    buf != &smi2021->scratch)
+		smi2021_progress(smi2021, buf);
+}
+
+/*
+ * Find the next 0xff byte in [p, end), or NULL if there is none.
+ * Checks a word at a time, as almost all the bytes we scan are video data.
+ */
+static u8 *smi2021_find_sync(u8 *p, u8 *end)
+{
+	unsigned long word;
+
+	while (p + sizeof(word) <= end) {
+		/* A 0xff byte in the data is a zero byte in the inverse */
+		word = ~get_unaligned((unsigned long *)p);
+		if ((word - REPEAT_BYTE(0x01)) & ~word & REPEAT_BYTE(0x80))
+			break;
+		p += sizeof(word);
 	}
+
+	return memchr(p, 0xff, end - p);
+}
+
+/*
+ * Track the position in the active video line around parse_trc().
+ * We are locked to the line structure as long as every EAV arrives
+ * exactly SMI2021_BYTES_PER_LINE bytes after the SAV of its line.
+ */
+static void parse_line_trc(struct smi2021 *smi2021, u8 trc)
+{
+	if (is_sav(trc)) {
+		smi2021->line_pos = is_active_video(trc) ? 0 : -1;
+	} else {
+		smi2021->line_locked =
+			smi2021->line_pos == SMI2021_BYTES_PER_LINE;
+		if (smi2021->line_pos >= 0 && !smi2021->line_locked)
+			smi2021->stats.sync_losses++;
+		smi2021->line_pos = -1;
+	}
+
+	parse_trc(smi2021, trc);
+}
+
+/*
+ * VBI lines are copied as well as handed to copy_video_block(),
+ * as the lines the slicer wants may be in the active video.
+ * The horizontal blanking after a line is dropped.
+ */
+static void copy_vbi_block(struct smi2021 *smi2021, const u8 *p, int size)
+{
+	int len = min(size, SMI2021_BYTES_PER_LINE - smi2021->vbi_pos);
+
+	memcpy(smi2021->vbi_dst + smi2021->vbi_pos, p, len);
+	smi2021->vbi_pos += len;
+	if (smi2021->vbi_pos < SMI2021_BYTES_PER_LINE)
+		return;
+
+	smi2021->vbi_pos = -1;
+	if (smi2021->vbi_sliced)
+		smi2021_vbi_slice(smi2021);
+}
+
+static void copy_line_block(struct smi2021 *smi2021, const u8 *p, int size)
+{
+	if (smi2021->line_pos >= 0)
+		smi2021->line_pos += size;
+
+	if (smi2021->vbi_pos >= 0)
+		copy_vbi_block(smi2021, p, size);
+	copy_video_block(smi2021, p, size);
 }
 
 /*
@@ -605,123 +1104,497 @@ static void copy_video_block(struct smi2021 *smi2021, u8 *p, int size)
  * SAV = Start Active Video.
  * EAV = End Active Video.
  * This is described in the saa7113 datasheet.
+ *
+ * The values 0x00 and 0xff are reserved for the timing reference codes,
+ * so we only have to look for the 0xff byte to find the next header,
+ * everything in between is copied in one go.
+ *
+ * Once we are locked to the line structure, we don't scan the active
+ * video at all, but copy the whole line and check that the EAV is where
+ * we expect it. We go back to scanning if it is not.
  */
 static void parse_video(struct smi2021 *smi2021, u8 *p, int size)
 {
-	int i, start_copy, copy_size, correct1;
-
-	static u8 trimed[2] = { 0xff, 0x00 };
-
-	correct1 = 0;
-	start_copy = 0;
+	static const u8 trc_header[3] = { 0xff, 0x00, 0x00 };
+	u8 *end = p + size;
+	u8 *start;
+	u8 *sync;
+	int left;
 
-	if ( smi2021->sync_state == SYNCZ1 ) {
-		if (p[0] == 0x00 && p[1] == 0x00) {
-			start_copy = 3;
-		} else {
-			copy_video_block(smi2021, &(trimed[0]), 1);
+	/*
+	 * Finish a timing reference code split over the previous chunk.
+	 * The header bytes we have already seen were held back from
+	 * copy_video_block(), if they turn out to be video data after all,
+	 * they are copied before anything else in this chunk.
+	 */
+	while (smi2021->sync_state != HSYNC && p < end) {
+		if (smi2021->sync_state == TRC) {
 			smi2021->sync_state = HSYNC;
+			parse_line_trc(smi2021, *p++);
+			break;
 		}
-	} else if ( smi2021->sync_state == SYNCZ2 ) {
-		if (p[0] == 0x00) {
-			start_copy = 2;
-		} else {
-			copy_video_block(smi2021, &(trimed[0]), 2);
+		if (*p != 0x00) {
+			copy_line_block(smi2021, trc_header, smi2021->sync_state);
 			smi2021->sync_state = HSYNC;
+			break;
+		}
+		smi2021->sync_state++;
+		p++;
+	}
+
+	start = p;
+	while (p < end) {
+		if (smi2021->line_locked && smi2021->line_pos >= 0 &&
+		    smi2021->line_pos < SMI2021_BYTES_PER_LINE) {
+			left = min_t(int, end - p,
+				SMI2021_BYTES_PER_LINE - smi2021->line_pos);
+			copy_line_block(smi2021, p, left);
+			p = start = p + left;
+
+			if (smi2021->line_pos < SMI2021_BYTES_PER_LINE)
+				break;
+
+			if (end - p >= 4 && !memcmp(p, trc_header, 3) &&
+			    !is_sav(p[3])) {
+				parse_line_trc(smi2021, p[3]);
+				p = start = p + 4;
+				continue;
+			}
+
+			/* A split EAV is left to the scanner below */
+			if (end - p >= 4)
+				smi2021->line_locked = false;
+		}
+
+		sync = smi2021_find_sync(p, end);
+		if (!sync)
+			break;
+
+		left = end - sync;
+		p = sync + 1;
+
+		if ((left > 1 && sync[1] != 0x00) ||
+		    (left > 2 && sync[2] != 0x00))
+			continue;
+
+		if (sync > start)
+			copy_line_block(smi2021, start, sync - start);
+
+		if (left < 4) {
+			/* Header continues in the next chunk */
+			smi2021->sync_state = left;
+			return;
+		}
+
+		parse_line_trc(smi2021, sync[3]);
+		p = start = sync + 4;
+	}
+
+	if (end > start)
+		copy_line_block(smi2021, start, end - start);
+}
+
+/*
+ * The device delivers data in chunks of 0x400 bytes.
+ * The four first bytes is a magic header to identify the chunks.
+ *	0xaa 0xaa 0x00 0x00 = saa7113 Active Video Data
+ *	0xaa 0xaa 0x00 0x01 = PCM - 24Bit 2 Channel audio data
+ */
+static void process_packet(struct smi2021 *smi2021, u8 *p, int size)
+{
+	int i;
+	u32 *header;
+
+	if (size % 0x400 != 0) {
+		smi2021->stats.bad_packets++;
+		printk_ratelimited(KERN_INFO "smi2021::%s: size: %d\n",
+				__func__, size);
+		return;
+	}
+
+	for (i = 0; i < size; i += 0x400) {
+		header = (u32 *)(p + i);
+		switch (*header) {
+		case cpu_to_be32(0xaaaa0000):
+			parse_video(smi2021, p+i+4, 0x400-4);
+			break;
+		case cpu_to_be32(0xaaaa0001):
+			smi2021_audio(smi2021, p+i+4, 0x400-4);
+			break;
 		}
 	}
+}
+
+/*
+ * Single producer, single consumer ring of transfer buffers.
+ * The completion handler is the only producer of done_ring and the only
+ * consumer of free_ring, the worker is the other side of both rings.
+ * Completions for our isoc endpoint are never run concurrently, and
+ * the spares of new urbs go into free_ring under parse_lock, as the
+ * worker's do.
+ */
+static bool smi2021_ring_put(struct smi2021_isoc_ring *ring,
+				struct smi2021_isoc_buf *buf)
+{
+	unsigned int head = ring->head;
+	unsigned int tail = READ_ONCE(ring->tail);
+
+	if (CIRC_SPACE(head, tail, ring->size) < 1)
+		return false;
+
+	ring->bufs[head] = buf;
+	smp_store_release(&ring->head, (head + 1) & (ring->size - 1));
+	return true;
+}
+
+static struct smi2021_isoc_buf *smi2021_ring_get(
+					struct smi2021_isoc_ring *ring)
+{
+	unsigned int head = smp_load_acquire(&ring->head);
+	unsigned int tail = ring->tail;
+	struct smi2021_isoc_buf *buf;
+
+	if (CIRC_CNT(head, tail, ring->size) < 1)
+		return NULL;
+
+	buf = ring->bufs[tail];
+	smp_store_release(&ring->tail, (tail + 1) & (ring->size - 1));
+	return buf;
+}
+
+static unsigned int smi2021_ring_count(struct smi2021_isoc_ring *ring)
+{
+	return CIRC_CNT(READ_ONCE(ring->head), READ_ONCE(ring->tail),
+								ring->size);
+}
+
+/*
+ * Adaptive urb depth, run from the worker once a second.
+ * A stray bad packet must not cause a resize. Double the number of
+ * urbs once transfers were late, dropped or could not be resubmitted
+ * in SMI2021_ISOC_ADAPT_BUSY seconds in a row, and give back a quarter
+ * of them after SMI2021_ISOC_ADAPT_IDLE quiet seconds. A depth that
+ * had trouble isn't gone back to, nor below the USB Transfers
+ * control, so an idle stream settles instead of walking down.
+ */
+static void smi2021_isoc_adapt(struct smi2021 *smi2021)
+{
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	unsigned int events;
+	int depth, target;
+
+	if (!smi2021->isoc_adaptive ||
+	    time_before(jiffies, isoc_ctl->adapt_next))
+		return;
+
+	isoc_ctl->adapt_next = jiffies + HZ;
+	depth = READ_ONCE(smi2021->isoc_target);
+
+	events = READ_ONCE(isoc_ctl->late_count) +
+		 READ_ONCE(isoc_ctl->ring_overruns) +
+		 READ_ONCE(isoc_ctl->resubmit_failures);
+
+	if (events != isoc_ctl->adapt_events) {
+		isoc_ctl->adapt_events = events;
+		isoc_ctl->adapt_idle = 0;
+		if (++isoc_ctl->adapt_busy < SMI2021_ISOC_ADAPT_BUSY)
+			return;
+		isoc_ctl->adapt_busy = 0;
+		isoc_ctl->adapt_floor = depth + 1;
+		target = depth * 2;
+	} else {
+		isoc_ctl->adapt_busy = 0;
+		if (++isoc_ctl->adapt_idle < SMI2021_ISOC_ADAPT_IDLE)
+			return;
+		isoc_ctl->adapt_idle = 0;
+		target = depth - depth / 4;
+		target = max3(target, (int)isoc_ctl->adapt_floor,
+				READ_ONCE(smi2021->isoc_transfers));
+	}
+
+	target = clamp(target, SMI2021_ISOC_TRANSFERS_MIN,
+					SMI2021_ISOC_TRANSFERS_MAX);
+	if (target == depth)
+		return;
+
+	WRITE_ONCE(smi2021->isoc_target, target);
+	schedule_work(&smi2021->isoc_resize_work);
+}
+
+/*
+ * All devices share one processing pool, a per-cpu workqueue.
+ * The completions of every device tend to come in on the one cpu
+ * handling the host controller interrupt, so each device gets a home
+ * cpu to parse on instead, spread round robin at probe or set with
+ * the Processing CPU control. When its home cpu already has another
+ * device waiting or running, the work is stolen by the least loaded
+ * online cpu. A run parses at most SMI2021_POOL_BATCH urbs and queues
+ * itself again behind the others, so a busy device can't starve them.
+ * A work item never runs twice at the same time, so the parser state
+ * of a device is still only touched by one thread at a time.
+ */
+struct smi2021_pool_cpu {
+	atomic_t	queued;		/* devices waiting to run here */
+	atomic_t	running;	/* devices parsing here */
+	atomic_long_t	runs;
+	atomic_long_t	urbs;
+	atomic_long_t	stolen;		/* runs here for another home cpu */
+	atomic64_t	busy_ns;
+};
+
+static struct workqueue_struct *smi2021_pool_wq;
+static struct smi2021_pool_cpu __percpu *smi2021_pool;
+static atomic_t smi2021_pool_next = ATOMIC_INIT(0);
+
+static int smi2021_pool_home(void)
+{
+	int n = atomic_inc_return(&smi2021_pool_next) - 1;
+	int cpu;
+
+	n %= num_online_cpus();
+	for_each_online_cpu(cpu)
+		if (n-- == 0)
+			return cpu;
+
+	return cpumask_first(cpu_online_mask);
+}
+
+static int smi2021_pool_load(int cpu)
+{
+	struct smi2021_pool_cpu *pc = per_cpu_ptr(smi2021_pool, cpu);
+
+	return atomic_read(&pc->queued) + atomic_read(&pc->running);
+}
+
+static int smi2021_pool_pick(struct smi2021 *smi2021)
+{
+	int cpu, home, best, load, best_load;
+
+	/* Queued behind the running work anyway, keep the count right */
+	cpu = READ_ONCE(smi2021->pool_running);
+	if (cpu >= 0)
+		return cpu;
+
+	home = READ_ONCE(smi2021->pool_hint);
+	if (home < 0)
+		home = smi2021->pool_home;
+
+	if (cpu_online(home)) {
+		if (!smi2021_pool_load(home))
+			return home;
+		best = home;
+	} else {
+		best = cpumask_first(cpu_online_mask);
+	}
+	best_load = smi2021_pool_load(best);
+
+	for_each_online_cpu(cpu) {
+		load = smi2021_pool_load(cpu);
+		if (load < best_load) {
+			best = cpu;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * The cpu a run is queued for is handed to it in pool_queued, so the
+ * load it adds there is taken off the same cpu, wherever it ends up
+ * running. Whoever swaps the cpu out of pool_queued takes it off.
+ */
+static void smi2021_pool_unqueue(struct smi2021 *smi2021, int cpu)
+{
+	if (cpu >= 0)
+		atomic_dec(&per_cpu_ptr(smi2021_pool, cpu)->queued);
+}
+
+/* Called from the completion handler, and by a run that has more */
+static void smi2021_pool_queue(struct smi2021 *smi2021)
+{
+	int cpu;
+
+	if (work_pending(&smi2021->isoc_work))
+		return;
+
+	cpu = smi2021_pool_pick(smi2021);
+	atomic_inc(&per_cpu_ptr(smi2021_pool, cpu)->queued);
+
+	/* The last run started, but hasn't taken its cpu off yet */
+	smi2021_pool_unqueue(smi2021, xchg(&smi2021->pool_queued, cpu));
+
+	queue_work_on(cpu, smi2021_pool_wq, &smi2021->isoc_work);
+}
+
+/* Urbs are killed, nothing queues the work again */
+static void smi2021_pool_cancel(struct smi2021 *smi2021)
+{
+	cancel_work_sync(&smi2021->isoc_work);
+	smi2021_pool_unqueue(smi2021, xchg(&smi2021->pool_queued, -1));
+}
+
+static void smi2021_pool_show_cpus(struct seq_file *s)
+{
+	struct smi2021_pool_cpu *pc;
+	int cpu;
+
+	seq_puts(s, "cpu  queued running        runs        urbs      stolen     busy ms\n");
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(smi2021_pool, cpu);
+		seq_printf(s, "%3d %7d %7d %11lu %11lu %11lu %11llu%s\n", cpu,
+			atomic_read(&pc->queued),
+			atomic_read(&pc->running),
+			atomic_long_read(&pc->runs),
+			atomic_long_read(&pc->urbs),
+			atomic_long_read(&pc->stolen),
+			(unsigned long long)div_u64(atomic64_read(&pc->busy_ns),
+							NSEC_PER_MSEC),
+			cpu_online(cpu) ? "" : " (offline)");
+	}
+}
 
-	for (i = 0; i < size; i++) {
-		if ( smi2021->blk_line_read > 1 ) {
-			if ( smi2021->to_blk_line_end > ( size - i ) ) {
-				smi2021->to_blk_line_end = smi2021->to_blk_line_end - ( size - i );
-				copy_size = size - start_copy;
-			} else {
-				copy_size = smi2021->to_blk_line_end;
-				smi2021->to_blk_line_end = SMI2021_BYTES_PER_LINE;
-				smi2021->blk_line_read = 0;
-			}
-			copy_video_block(smi2021, &(p[start_copy]), copy_size);
-			i = i + copy_size;
-			start_copy = i + 1 + 3;
-			if (i>=size)
-				continue;
-		}
-		switch (smi2021->sync_state) {
-		case HSYNC:
-			if (p[i] == 0xff)
-				smi2021->sync_state = SYNCZ1;
-			break;
-		case SYNCZ1:
-			if (p[i] == 0x00) {
-				smi2021->sync_state = SYNCZ2;
-			} else {
-				smi2021->sync_state = HSYNC;
-			}
-			break;
-		case SYNCZ2:
-			if (p[i] == 0x00) {
-				smi2021->sync_state = TRC;
-			} else {
-				smi2021->sync_state = HSYNC;
-			}
-			break;
-		case TRC:
-			smi2021->sync_state = HSYNC;
-			if ( i > (start_copy + 3) ) {
-				copy_size = i - 3 - start_copy;
-				copy_video_block(smi2021, &(p[start_copy]), copy_size);
-				smi2021->blk_line_read = 0;
-			}
-			start_copy = i + 1;
-			parse_trc(smi2021, p[i]);
-			smi2021->blk_line_read = smi2021->blk_line_read + 1;
+/*
+ * Parse the transfers handed over by smi2021_iso_cb().
+ * This runs in the shared pool, see above.
+ */
+static void smi2021_isoc_work(struct work_struct *work)
+{
+	struct smi2021 *smi2021 = container_of(work, struct smi2021,
+						isoc_work);
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	struct smi2021_pool_cpu *pc;
+	struct smi2021_isoc_buf *buf;
+	unsigned int bytes;
+	unsigned long urbs = 0;
+	int i, cpu, home;
+	u64 start;
+
+	smi2021_pool_unqueue(smi2021, xchg(&smi2021->pool_queued, -1));
+
+	/* Accounted to the cpu it really runs on */
+	cpu = raw_smp_processor_id();
+	pc = per_cpu_ptr(smi2021_pool, cpu);
+	atomic_inc(&pc->running);
+	WRITE_ONCE(smi2021->pool_running, cpu);
+
+	home = READ_ONCE(smi2021->pool_hint);
+	if (home < 0)
+		home = smi2021->pool_home;
+	if (cpu != home)
+		atomic_long_inc(&pc->stolen);
+
+	start = ktime_to_ns(ktime_get());
+
+	while (urbs < SMI2021_POOL_BATCH &&
+	       (buf = smi2021_ring_get(&isoc_ctl->done_ring)) != NULL) {
+		urbs++;
+		bytes = 0;
+		mutex_lock(&smi2021->parse_lock);
+		for (i = 0; i < buf->num_packets; i++) {
+			smi2021->packet_ts = buf->start_ns +
+					(u64)i * buf->packet_ns;
+			bytes += buf->actual_length[i];
+			process_packet(smi2021,
+					buf->data + i * isoc_ctl->max_pkt_size,
+					buf->actual_length[i]);
 		}
+		smi2021->stats.bytes += bytes;
+		trace_smi2021_urb_parsed(buf->seq, bytes);
+
+		smi2021_ring_put(&isoc_ctl->free_ring, buf);
+		mutex_unlock(&smi2021->parse_lock);
 	}
-	if ( start_copy < size ) {
-		if ( smi2021->sync_state == SYNCZ1 )
-			correct1 = 1;
-		else if ( smi2021->sync_state == SYNCZ2 )
-			correct1 = 2;
-		copy_size = size - start_copy - correct1;
-		copy_video_block(smi2021, &(p[start_copy]), copy_size);
-	}
+
+	smi2021_isoc_adapt(smi2021);
+
+	atomic64_add(ktime_to_ns(ktime_get()) - start, &pc->busy_ns);
+	atomic_long_add(urbs, &pc->urbs);
+	atomic_long_inc(&pc->runs);
+
+	/* Still running, so this goes to the back of the same cpu */
+	if (smi2021_ring_count(&isoc_ctl->done_ring))
+		smi2021_pool_queue(smi2021);
+
+	atomic_dec(&pc->running);
+	WRITE_ONCE(smi2021->pool_running, -1);
 }
 
 /*
- * The device delivers data in chunks of 0x400 bytes.
- * The four first bytes is a magic header to identify the chunks.
- *	0xaa 0xaa 0x00 0x00 = saa7113 Active Video Data
- *	0xaa 0xaa 0x00 0x01 = PCM - 24Bit 2 Channel audio data
+ * Recover when the first packet of an urb went over the bus, from its
+ * start frame. The frame counter wraps after at most 1024 frames, or
+ * 8192 microframes at high speed, and counts microframes at high speed.
  */
-static void process_packet(struct smi2021 *smi2021, u8 *p, int size)
-{
-	int i;
-	u32 *header;
+#define SMI2021_FS_FRAME_MASK		0x3ff
+#define SMI2021_HS_FRAME_MASK		0x1fff
 
-	if (size % 0x400 != 0) {
-		printk_ratelimited(KERN_INFO "smi2021::%s: size: %d\n",
-				__func__, size);
-		return;
+/* Smoothing of the bus clock against ours, as 1 / 2^shift per urb */
+#define SMI2021_CLOCK_SHIFT		4
+#define SMI2021_CLOCK_MAX_ERROR		(10 * NSEC_PER_MSEC)
+
+/*
+ * The completion time less the length of the urb gives the start of
+ * its first packet, late by however long the interrupt took. The frame
+ * counter predicts the same time from the previous urb, so filtering
+ * the difference tracks the drift between the clocks while averaging
+ * out the completion latency. Start over after a gap the counter may
+ * have wrapped in, or an error that can't be jitter.
+ */
+static void smi2021_isoc_clock(struct smi2021 *smi2021, struct urb *ip,
+				struct smi2021_isoc_buf *buf)
+{
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	bool high_speed = smi2021->udev->speed == USB_SPEED_HIGH;
+	u32 period = high_speed ? NSEC_PER_USEC * 125 : NSEC_PER_MSEC;
+	u32 mask = high_speed ? SMI2021_HS_FRAME_MASK : SMI2021_FS_FRAME_MASK;
+	u64 now = ktime_to_ns(ktime_get());
+	u64 start;
+	s64 error;
+
+	buf->packet_ns = ip->interval * period;
+	start = now - (u64)ip->number_of_packets * buf->packet_ns;
+
+	if (isoc_ctl->ts_valid && now - isoc_ctl->ts_seen < NSEC_PER_SEC / 2) {
+		isoc_ctl->ts_ns += (u64)((ip->start_frame -
+					isoc_ctl->ts_frame) & mask) * period;
+		error = start - isoc_ctl->ts_ns;
+		if (error > -SMI2021_CLOCK_MAX_ERROR &&
+		    error < SMI2021_CLOCK_MAX_ERROR)
+			isoc_ctl->ts_ns += error >> SMI2021_CLOCK_SHIFT;
+		else
+			isoc_ctl->ts_ns = start;
+	} else {
+		isoc_ctl->ts_ns = start;
 	}
 
-	for (i = 0; i < size; i += 0x400) {
-		header = (u32 *)(p + i);
-		switch (*header) {
-		case cpu_to_be32(0xaaaa0000):
-			parse_video(smi2021, p+i+4, 0x400-4);
-			break;
-		case cpu_to_be32(0xaaaa0001):
-			smi2021_audio(smi2021, p+i+4, 0x400-4);
+	isoc_ctl->ts_valid = true;
+	isoc_ctl->ts_frame = ip->start_frame;
+	isoc_ctl->ts_seen = now;
+	buf->start_ns = isoc_ctl->ts_ns;
+}
+
+/* Only looked up while the depth shrinks, or when a resubmit fails */
+static int smi2021_urb_slot(struct smi2021_isoc_ctl *isoc_ctl,
+				struct urb *ip)
+{
+	int i;
+
+	for (i = 0; i < SMI2021_ISOC_TRANSFERS_MAX; i++) {
+		if (isoc_ctl->urb[i] == ip)
 			break;
-		}
 	}
+
+	return i;
 }
 
 static void smi2021_iso_cb(struct urb *ip)
 {
-	struct smi2021 *smi2021 = ip->context;
-	int i;
+	struct smi2021_isoc_buf *buf = ip->context;
+	struct smi2021 *smi2021 = buf->smi2021;
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	struct smi2021_isoc_buf *spare;
+	unsigned int depth;
+	int i, slot, target;
 
 	switch (ip->status) {
 	case 0:
@@ -735,31 +1608,84 @@ static void smi2021_iso_cb(struct urb *ip)
 		return;
 	/* Unknown error, retry */
 	default:
+		smi2021->stats.urb_errors++;
 		dev_warn(smi2021->dev, "urb error! status %d\n", ip->status);
 		return;
 	}
 
-	for (i = 0; i < ip->number_of_packets; i++) {
-		int size = ip->iso_frame_desc[i].actual_length;
-		unsigned char *data = ip->transfer_buffer +
-				ip->iso_frame_desc[i].offset;
-
-		process_packet(smi2021, data, size);
+	/*
+	 * Hand the filled buffer to the worker and resubmit the urb
+	 * with a spare one. If the worker has fallen so far behind
+	 * that there are no spares left, this transfer is dropped.
+	 */
+	if (ip->error_count)
+		isoc_ctl->late_count++;
+
+	smi2021_isoc_clock(smi2021, ip, buf);
+	buf->seq = isoc_ctl->urb_seq++;
+
+	spare = smi2021_ring_get(&isoc_ctl->free_ring);
+	trace_smi2021_urb_done(buf->seq, ip->start_frame,
+			ip->number_of_packets, ip->error_count,
+			buf->start_ns, !spare);
+	if (spare) {
+		for (i = 0; i < ip->number_of_packets; i++)
+			buf->actual_length[i] =
+				ip->iso_frame_desc[i].actual_length;
+		buf->num_packets = ip->number_of_packets;
+
+		smi2021_ring_put(&isoc_ctl->done_ring, buf);
+		smi2021_pool_queue(smi2021);
+
+		depth = smi2021_ring_count(&isoc_ctl->done_ring);
+		if (depth > isoc_ctl->ring_high_water)
+			isoc_ctl->ring_high_water = depth;
+
+		ip->transfer_buffer = spare->data;
+		ip->transfer_dma = spare->dma;
+		ip->context = spare;
+	} else {
+		isoc_ctl->ring_overruns++;
+	}
 
+	for (i = 0; i < ip->number_of_packets; i++) {
 		ip->iso_frame_desc[i].status = 0;
 		ip->iso_frame_desc[i].actual_length = 0;
 	}
 
+	/*
+	 * While the depth shrinks, the urbs past isoc_target retire one
+	 * at a time as they complete, and keep their buffer for a regrow.
+	 */
+	target = READ_ONCE(smi2021->isoc_target);
+	if (find_next_bit(isoc_ctl->live, SMI2021_ISOC_TRANSFERS_MAX,
+				target) < SMI2021_ISOC_TRANSFERS_MAX) {
+		slot = smi2021_urb_slot(isoc_ctl, ip);
+		if (slot >= target) {
+			clear_bit(slot, isoc_ctl->live);
+			/* Unless smi2021_submit_isoc() just grew it back */
+			smp_mb__after_atomic();
+			if (slot >= READ_ONCE(smi2021->isoc_target) ||
+			    test_and_set_bit(slot, isoc_ctl->live))
+				return;
+		}
+	}
+
 	ip->status = 0;
 	ip->status = usb_submit_urb(ip, GFP_ATOMIC);
-	if (ip->status)
+	if (ip->status) {
+		isoc_ctl->resubmit_failures++;
+		clear_bit(smi2021_urb_slot(isoc_ctl, ip), isoc_ctl->live);
 		dev_warn(smi2021->dev, "urb re-submit failed (%d)\n", ip->status);
+	}
 
 }
 
 static void smi2021_cancel_isoc(struct smi2021 *smi2021)
 {
-	int i, num_bufs = smi2021->isoc_ctl.num_bufs;
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	struct smi2021_isoc_buf *buf;
+	int i, num_bufs = isoc_ctl->num_bufs;
 
 	dev_notice(smi2021->dev, "killing %d urbs...\n", num_bufs);
 
@@ -769,7 +1695,15 @@ static void smi2021_cancel_isoc(struct smi2021 *smi2021)
 		 * We don't care for NULL pointers since
 		 * usb_kill_urb allows it.
 		 */
-		usb_kill_urb(smi2021->isoc_ctl.urb[i]);
+		usb_kill_urb(isoc_ctl->urb[i]);
+	}
+	bitmap_zero(isoc_ctl->live, SMI2021_ISOC_TRANSFERS_MAX);
+
+	/* Throw away whatever the worker didn't get to */
+	smi2021_pool_cancel(smi2021);
+	if (num_bufs) {
+		while ((buf = smi2021_ring_get(&isoc_ctl->done_ring)) != NULL)
+			smi2021_ring_put(&isoc_ctl->free_ring, buf);
 	}
 
 	dev_notice(smi2021->dev, "all urbs killed\n");
@@ -781,29 +1715,32 @@ static void smi2021_cancel_isoc(struct smi2021 *smi2021)
  */
 static void smi2021_free_isoc(struct smi2021 *smi2021)
 {
-	struct urb *urb;
-	int i, num_bufs = smi2021->isoc_ctl.num_bufs;
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	int i, num_bufs = isoc_ctl->num_bufs;
 
 	dev_info(smi2021->dev, "freeing %d urb buffers...\n", num_bufs);
 
-	for (i = 0; i < num_bufs; i++) {
-		urb = smi2021->isoc_ctl.urb[i];
+	for (i = 0; isoc_ctl->urb && i < num_bufs; i++)
+		usb_free_urb(isoc_ctl->urb[i]);
 
-		if (unlikely(!urb))
-			continue;
-		if (smi2021->isoc_ctl.transfer_buffer[i])
-			kfree(smi2021->isoc_ctl.transfer_buffer[i]);
-		usb_free_urb(urb);
-		smi2021->isoc_ctl.urb[i] = NULL;
-		smi2021->isoc_ctl.transfer_buffer[i] = NULL;
+	/* Every urb has a transfer buffer, and there is one spare per urb */
+	for (i = 0; isoc_ctl->bufs && i < num_bufs * 2; i++) {
+		if (isoc_ctl->bufs[i].data)
+			usb_free_coherent(smi2021->udev, isoc_ctl->buf_size,
+					isoc_ctl->bufs[i].data,
+					isoc_ctl->bufs[i].dma);
 	}
 
-	kfree(smi2021->isoc_ctl.urb);
-	kfree(smi2021->isoc_ctl.transfer_buffer);
+	kfree(isoc_ctl->urb);
+	kfree(isoc_ctl->bufs);
+	kfree(isoc_ctl->free_ring.bufs);
+	kfree(isoc_ctl->done_ring.bufs);
 
-	smi2021->isoc_ctl.urb = NULL;
-	smi2021->isoc_ctl.transfer_buffer = NULL;
-	smi2021->isoc_ctl.num_bufs = 0;
+	isoc_ctl->urb = NULL;
+	isoc_ctl->bufs = NULL;
+	isoc_ctl->free_ring.bufs = NULL;
+	isoc_ctl->done_ring.bufs = NULL;
+	isoc_ctl->num_bufs = 0;
 
 	dev_info(smi2021->dev, "all urb buffers freed\n");
 }
@@ -814,86 +1751,408 @@ static void smi2021_uninit_isoc(struct smi2021 *smi2021)
 	smi2021_free_isoc(smi2021);
 }
 
+static int smi2021_init_ring(struct smi2021_isoc_ring *ring,
+				unsigned int entries, int node)
+{
+	ring->size = roundup_pow_of_two(entries + 1);
+	ring->head = 0;
+	ring->tail = 0;
+	ring->bufs = kzalloc_node(ring->size * sizeof(*ring->bufs),
+							GFP_KERNEL, node);
+
+	return ring->bufs ? 0 : -ENOMEM;
+}
+
+/*
+ * Set up the urb slots and the rings for any depth up to
+ * SMI2021_ISOC_TRANSFERS_MAX. The urbs themselves are allocated by
+ * smi2021_submit_isoc(), the first time the depth reaches them.
+ */
 static int smi2021_alloc_isoc(struct smi2021 *smi2021)
 {
-	struct urb *urb;
-	int i, j, sb_size, max_packets, num_bufs;
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	int node;
 
 	/*
 	 * It may be necessary to release isoc here,
 	 * since isocs are only released on disconnect.
 	 */
-	if (smi2021->isoc_ctl.num_bufs)
+	if (isoc_ctl->urb)
 		smi2021_uninit_isoc(smi2021);
 
-	dev_info(smi2021->dev, "allocating urbs...\n");
-
-	num_bufs = SMI2021_ISOC_TRANSFERS;
-	max_packets = SMI2021_ISOC_PACKETS;
-	sb_size = max_packets * smi2021->iso_size;
+	isoc_ctl->num_packets = smi2021->isoc_packets;
+	isoc_ctl->max_pkt_size = smi2021->iso_size;
+	isoc_ctl->buf_size = isoc_ctl->num_packets * smi2021->iso_size;
 
-	smi2021->cur_buf = NULL;
-	smi2021->sync_state = HSYNC;
-	smi2021->isoc_ctl.max_pkt_size = smi2021->iso_size;
-	smi2021->isoc_ctl.urb = kzalloc(sizeof(void *)*num_bufs, GFP_KERNEL);
-	if (!smi2021->isoc_ctl.urb) {
+	/*
+	 * Keep everything the completion handler and the worker touch
+	 * on the NUMA node of the host controller. The transfer buffers
+	 * are coherent, so they follow the controller already.
+	 */
+	node = dev_to_node(smi2021->udev->bus->controller);
+
+	isoc_ctl->urb = kzalloc_node(SMI2021_ISOC_TRANSFERS_MAX *
+					sizeof(void *), GFP_KERNEL, node);
+	isoc_ctl->bufs = kzalloc_node(SMI2021_ISOC_TRANSFERS_MAX * 2 *
+				sizeof(*isoc_ctl->bufs), GFP_KERNEL, node);
+	if (!isoc_ctl->urb || !isoc_ctl->bufs ||
+	    smi2021_init_ring(&isoc_ctl->free_ring,
+				SMI2021_ISOC_TRANSFERS_MAX * 2, node) < 0 ||
+	    smi2021_init_ring(&isoc_ctl->done_ring,
+				SMI2021_ISOC_TRANSFERS_MAX * 2, node) < 0) {
 		dev_err(smi2021->dev, "out of memory for urb array");
+		smi2021_free_isoc(smi2021);
 		return -ENOMEM;
 	}
 
-	smi2021->isoc_ctl.transfer_buffer = kzalloc(sizeof(void *)*num_bufs,
-								GFP_KERNEL);
-	if (!smi2021->isoc_ctl.transfer_buffer) {
-		dev_err(smi2021->dev, "out of memory for usb transfers");
-		kfree(smi2021->isoc_ctl.urb);
-		return -ENOMEM;
-	}
+	return 0;
+}
 
-	/* allocate urbs and transfer buffers */
-	for (i = 0; i < num_bufs; i++) {
-		urb = usb_alloc_urb(max_packets, GFP_KERNEL);
-		if (!urb) {
-			dev_err(smi2021->dev, "cannot allocate urb[%d]\n", i);
-			goto err_out;
-		}
-		smi2021->isoc_ctl.urb[i] = urb;
-		smi2021->isoc_ctl.transfer_buffer[i] = kzalloc(sb_size, GFP_KERNEL);
-		if (!smi2021->isoc_ctl.transfer_buffer[i]) {
+/* Allocate the urb in slot i, with its transfer buffer and a spare */
+static int smi2021_alloc_urb(struct smi2021 *smi2021, int i)
+{
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	struct smi2021_isoc_buf *buf;
+	struct urb *urb;
+	int j;
+
+	for (j = 2 * i; j < 2 * i + 2; j++) {
+		buf = &isoc_ctl->bufs[j];
+		buf->smi2021 = smi2021;
+		buf->data = usb_alloc_coherent(smi2021->udev,
+				isoc_ctl->buf_size, GFP_KERNEL, &buf->dma);
+		if (!buf->data) {
 			dev_err(smi2021->dev,
 				"cannot alloc %d bytes for tx[%d] buffer\n",
-								sb_size, i);
+						isoc_ctl->buf_size, j);
 			goto err_out;
 		}
+	}
 
-		urb->dev = smi2021->udev;
-		urb->pipe = usb_rcvisocpipe(smi2021->udev, SMI2021_ISOC_EP);
-		urb->transfer_buffer = smi2021->isoc_ctl.transfer_buffer[i];
-		urb->transfer_buffer_length = sb_size;
-		urb->complete = smi2021_iso_cb;
-		urb->context = smi2021;
-		urb->interval = 1;
-		urb->start_frame = 0;
-		urb->number_of_packets = max_packets;
-		urb->transfer_flags = URB_ISO_ASAP;
-		for (j = 0; j < max_packets; j++) {
-			urb->iso_frame_desc[j].offset = smi2021->iso_size * j;
-			urb->iso_frame_desc[j].length = smi2021->iso_size;
-		}
+	urb = usb_alloc_urb(isoc_ctl->num_packets, GFP_KERNEL);
+	if (!urb) {
+		dev_err(smi2021->dev, "cannot allocate urb[%d]\n", i);
+		goto err_out;
+	}
+	isoc_ctl->urb[i] = urb;
+
+	urb->dev = smi2021->udev;
+	urb->pipe = usb_rcvisocpipe(smi2021->udev, SMI2021_ISOC_EP);
+	urb->transfer_buffer = isoc_ctl->bufs[2 * i].data;
+	urb->transfer_dma = isoc_ctl->bufs[2 * i].dma;
+	urb->transfer_buffer_length = isoc_ctl->buf_size;
+	urb->complete = smi2021_iso_cb;
+	urb->context = &isoc_ctl->bufs[2 * i];
+	urb->interval = 1;
+	urb->start_frame = 0;
+	urb->number_of_packets = isoc_ctl->num_packets;
+	urb->transfer_flags = URB_ISO_ASAP | URB_NO_TRANSFER_DMA_MAP;
+	for (j = 0; j < isoc_ctl->num_packets; j++) {
+		urb->iso_frame_desc[j].offset = isoc_ctl->max_pkt_size * j;
+		urb->iso_frame_desc[j].length = isoc_ctl->max_pkt_size;
 	}
 
-	dev_info(smi2021->dev, "%d urbs of %d bytes, allocated\n", num_bufs,
-								sb_size);
-	smi2021->isoc_ctl.num_bufs = num_bufs;
+	mutex_lock(&smi2021->parse_lock);
+	smi2021_ring_put(&isoc_ctl->free_ring, &isoc_ctl->bufs[2 * i + 1]);
+	mutex_unlock(&smi2021->parse_lock);
 
 	return 0;
 
 err_out:
-	/* Save the allocataed buffers so far, so we can properly free them */
-	smi2021->isoc_ctl.num_bufs = i+1;
-	smi2021_free_isoc(smi2021);
+	for (j = 2 * i; j < 2 * i + 2; j++) {
+		buf = &isoc_ctl->bufs[j];
+		if (buf->data)
+			usb_free_coherent(smi2021->udev, isoc_ctl->buf_size,
+						buf->data, buf->dma);
+		buf->data = NULL;
+	}
 	return -ENOMEM;
 }
 
+/*
+ * Submit the urbs up to isoc_target that aren't in flight, allocating
+ * the ones the depth never reached before. The urbs already in flight
+ * carry on, so growing the depth loses nothing.
+ */
+static int smi2021_submit_isoc(struct smi2021 *smi2021)
+{
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+	int i, rc;
+
+	for (i = 0; i < READ_ONCE(smi2021->isoc_target); i++) {
+		if (i == isoc_ctl->num_bufs) {
+			rc = smi2021_alloc_urb(smi2021, i);
+			if (rc < 0)
+				goto err_out;
+			isoc_ctl->num_bufs++;
+		}
+
+		/* Still in flight, or a retiring urb saw the new target */
+		if (test_and_set_bit(i, isoc_ctl->live))
+			continue;
+
+		rc = usb_submit_urb(isoc_ctl->urb[i], GFP_KERNEL);
+		if (rc) {
+			clear_bit(i, isoc_ctl->live);
+			dev_err(smi2021->dev, "cannot submit urb[%d] (%d)\n",
+									i, rc);
+			goto err_out;
+		}
+	}
+
+	return 0;
+
+err_out:
+	/* Carry on with the urbs that made it */
+	WRITE_ONCE(smi2021->isoc_target, i);
+	return rc;
+}
+
+static void smi2021_reset_sync(struct smi2021 *smi2021)
+{
+	smi2021->sync_state = HSYNC;
+	smi2021->line_locked = false;
+	smi2021->line_pos = -1;
+	smi2021->vbi_pos = -1;
+}
+
+/*
+ * Grow the urbs while streaming to the depth in isoc_target, without
+ * touching the ones in flight. Shrinking needs nothing from here, the
+ * completion handler retires the urbs past the target.
+ */
+static void smi2021_isoc_resize_work(struct work_struct *work)
+{
+	struct smi2021 *smi2021 = container_of(work, struct smi2021,
+						isoc_resize_work);
+	int old, target, rc;
+
+	mutex_lock(&smi2021->v4l2_lock);
+
+	old = bitmap_weight(smi2021->isoc_ctl.live,
+				SMI2021_ISOC_TRANSFERS_MAX);
+	target = READ_ONCE(smi2021->isoc_target);
+	if (!smi2021->streaming || !smi2021->udev || target == old)
+		goto out;
+
+	rc = smi2021_submit_isoc(smi2021);
+
+	smi2021->isoc_ctl.resizes++;
+	if (rc < 0)
+		dev_err(smi2021->dev, "urb resize from %d to %d failed at frame %d (%d)\n",
+			old, target, smi2021->sequence, rc);
+	else
+		dev_info(smi2021->dev, "urbs resized from %d to %d at frame %d\n",
+			old, target, smi2021->sequence);
+
+out:
+	mutex_unlock(&smi2021->v4l2_lock);
+}
+
+static int smi2021_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct smi2021 *smi2021 = container_of(ctrl->handler, struct smi2021,
+						ctrl_handler);
+
+	switch (ctrl->id) {
+	case SMI2021_CID_ISOC_TRANSFERS:
+		WRITE_ONCE(smi2021->isoc_transfers, ctrl->val);
+		WRITE_ONCE(smi2021->isoc_target, ctrl->val);
+		if (smi2021->streaming)
+			schedule_work(&smi2021->isoc_resize_work);
+		break;
+	case SMI2021_CID_ISOC_PACKETS:
+		/* Grabbed while streaming, used from the next start */
+		smi2021->isoc_packets = ctrl->val;
+		break;
+	case SMI2021_CID_ISOC_ADAPTIVE:
+		smi2021->isoc_adaptive = ctrl->val;
+		break;
+	case SMI2021_CID_PROGRESS_LINES:
+		WRITE_ONCE(smi2021->progress_lines, ctrl->val);
+		break;
+	case SMI2021_CID_REPEAT_FRAME:
+		WRITE_ONCE(smi2021->repeat_frame, ctrl->val);
+		break;
+	case SMI2021_CID_PROCESSING_CPU:
+		if (ctrl->val >= 0 && !cpu_online(ctrl->val))
+			return -EINVAL;
+		WRITE_ONCE(smi2021->pool_hint, ctrl->val);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static const struct v4l2_ctrl_ops smi2021_ctrl_ops = {
+	.s_ctrl = smi2021_s_ctrl,
+};
+
+static const struct v4l2_ctrl_config smi2021_ctrl_isoc_transfers = {
+	.ops = &smi2021_ctrl_ops,
+	.id = SMI2021_CID_ISOC_TRANSFERS,
+	.name = "USB Transfers",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = SMI2021_ISOC_TRANSFERS_MIN,
+	.max = SMI2021_ISOC_TRANSFERS_MAX,
+	.step = 1,
+	.def = SMI2021_ISOC_TRANSFERS,
+};
+
+static const struct v4l2_ctrl_config smi2021_ctrl_isoc_packets = {
+	.ops = &smi2021_ctrl_ops,
+	.id = SMI2021_CID_ISOC_PACKETS,
+	.name = "USB Packets per Transfer",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 1,
+	.max = SMI2021_ISOC_PACKETS_MAX,
+	.step = 1,
+	.def = SMI2021_ISOC_PACKETS,
+};
+
+static const struct v4l2_ctrl_config smi2021_ctrl_isoc_adaptive = {
+	.ops = &smi2021_ctrl_ops,
+	.id = SMI2021_CID_ISOC_ADAPTIVE,
+	.name = "USB Adaptive Transfers",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config smi2021_ctrl_progress_lines = {
+	.ops = &smi2021_ctrl_ops,
+	.id = SMI2021_CID_PROGRESS_LINES,
+	.name = "Progress Lines",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = SMI2021_PAL_LINES,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config smi2021_ctrl_repeat_frame = {
+	.ops = &smi2021_ctrl_ops,
+	.id = SMI2021_CID_REPEAT_FRAME,
+	.name = "Repeat Last Frame",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+/* -1 leaves the choice to the pool */
+static const struct v4l2_ctrl_config smi2021_ctrl_processing_cpu = {
+	.ops = &smi2021_ctrl_ops,
+	.id = SMI2021_CID_PROCESSING_CPU,
+	.name = "Processing CPU",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = -1,
+	.max = NR_CPUS - 1,
+	.step = 1,
+	.def = -1,
+};
+
+/*
+ * Capture statistics, printed to debugfs/smi2021/<device>/stats or to
+ * the kernel log for VIDIOC_LOG_STATUS.
+ */
+static struct dentry *smi2021_debugfs_root;
+
+#define smi2021_stat(s, smi2021, fmt, ...)				\
+do {									\
+	if (s)								\
+		seq_printf(s, fmt "\n", __VA_ARGS__);			\
+	else								\
+		v4l2_info(&(smi2021)->v4l2_dev, fmt "\n", __VA_ARGS__);	\
+} while (0)
+
+static void smi2021_print_stats(struct smi2021 *smi2021, struct seq_file *s)
+{
+	struct smi2021_stats *stats = &smi2021->stats;
+	struct smi2021_isoc_ctl *isoc_ctl = &smi2021->isoc_ctl;
+
+	smi2021_stat(s, smi2021, "frames delivered:   %lu",
+			READ_ONCE(stats->frames_done));
+	smi2021_stat(s, smi2021, "frames dropped:     %lu",
+			READ_ONCE(stats->frames_dropped));
+	smi2021_stat(s, smi2021, "frames broken:      %lu",
+			READ_ONCE(stats->frames_broken));
+	smi2021_stat(s, smi2021, "frames repeated:    %lu",
+			READ_ONCE(stats->frames_repeated));
+	smi2021_stat(s, smi2021, "sync losses:        %lu",
+			READ_ONCE(stats->sync_losses));
+	smi2021_stat(s, smi2021, "bad packets:        %lu",
+			READ_ONCE(stats->bad_packets));
+	smi2021_stat(s, smi2021, "audio resyncs:      %lu",
+			READ_ONCE(stats->audio_resyncs));
+	smi2021_stat(s, smi2021, "audio rejected:     %lu",
+			READ_ONCE(stats->audio_rejected));
+	smi2021_stat(s, smi2021, "a/v offset:         %lld us",
+			div_s64(READ_ONCE(stats->av_offset), NSEC_PER_USEC));
+	smi2021_stat(s, smi2021, "bytes received:     %llu",
+			(unsigned long long)READ_ONCE(stats->bytes));
+	smi2021_stat(s, smi2021, "urb errors:         %lu",
+			READ_ONCE(stats->urb_errors));
+	smi2021_stat(s, smi2021, "late urbs:          %u",
+			READ_ONCE(isoc_ctl->late_count));
+	smi2021_stat(s, smi2021, "resubmit failures:  %u",
+			READ_ONCE(isoc_ctl->resubmit_failures));
+	smi2021_stat(s, smi2021, "ring overruns:      %u",
+			READ_ONCE(isoc_ctl->ring_overruns));
+	smi2021_stat(s, smi2021, "home cpu:           %d",
+			READ_ONCE(smi2021->pool_hint) < 0 ?
+			smi2021->pool_home : READ_ONCE(smi2021->pool_hint));
+}
+
+void smi2021_log_stats(struct smi2021 *smi2021)
+{
+	smi2021_print_stats(smi2021, NULL);
+}
+
+static int smi2021_stats_show(struct seq_file *s, void *unused)
+{
+	smi2021_print_stats(s->private, s);
+	return 0;
+}
+
+static int smi2021_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smi2021_stats_show, inode->i_private);
+}
+
+static const struct file_operations smi2021_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = smi2021_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Load of the shared processing pool, debugfs/smi2021/pool */
+static int smi2021_pool_show(struct seq_file *s, void *unused)
+{
+	smi2021_pool_show_cpus(s);
+	return 0;
+}
+
+static int smi2021_pool_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, smi2021_pool_show, NULL);
+}
+
+static const struct file_operations smi2021_pool_fops = {
+	.owner = THIS_MODULE,
+	.open = smi2021_pool_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 void smi2021_toggle_audio(struct smi2021 *smi2021, bool enable)
 {
 	/*
@@ -908,11 +2167,32 @@ void smi2021_toggle_audio(struct smi2021 *smi2021, bool enable)
 		smi2021_set_reg(smi2021, 0, 0x1740, 0x00);
 }
 
-int smi2021_start(struct smi2021 *smi2021)
+/* Return the buffers of the video or the vbi queue */
+static void smi2021_clear_vq(struct smi2021 *smi2021, struct vb2_queue *vq)
+{
+	if (vq == &smi2021->vb_vbiq)
+		smi2021_clear_vbi_queue(smi2021);
+	else
+		smi2021_clear_queue(smi2021);
+}
+
+/* GREY has no use for the chroma, so ask for monochrome too */
+static void smi2021_set_chroma(struct smi2021 *smi2021)
+{
+	if (monochrome || smi2021->cur_pixelformat == V4L2_PIX_FMT_GREY)
+		smi2021_set_reg(smi2021, 0x4a, 0x11, 0x0d);
+	else
+		smi2021_set_reg(smi2021, 0x4a, 0x11, 0x0c);
+}
+
+/*
+ * The video and vbi nodes share the stream from the device,
+ * it is started by the first of them and stopped by the last.
+ */
+int smi2021_start(struct smi2021 *smi2021, struct vb2_queue *vq)
 {
 	int i, rc;
 	u8 reg;
-	smi2021->sync_state = HSYNC;
 
 	/* Check device presence */
 	if (!smi2021->udev)
@@ -921,6 +2201,15 @@ int smi2021_start(struct smi2021 *smi2021)
 	if (mutex_lock_interruptible(&smi2021->v4l2_lock))
 		return -ERESTARTSYS;
 
+	if (smi2021->stream_users) {
+		/* The vbi node started the stream, with whatever format */
+		if (vq == &smi2021->vb_vidq)
+			smi2021_set_chroma(smi2021);
+		smi2021->stream_users++;
+		mutex_unlock(&smi2021->v4l2_lock);
+		return 0;
+	}
+
 	v4l2_subdev_call(smi2021->gm7113c_subdev, video, s_stream, 1);
 
 	/*
@@ -948,26 +2237,45 @@ int smi2021_start(struct smi2021 *smi2021)
 	if (rc < 0)
 		goto start_fail;
 
-	if (monochrome) {
-		smi2021_set_reg(smi2021, 0x4a, 0x11, 0x0d );
-	}
+	smi2021_set_chroma(smi2021);
 
 	smi2021_toggle_audio(smi2021, false);
 
-	if (!smi2021->isoc_ctl.num_bufs) {
+	/*
+	 * The urbs and their coherent buffers are kept until disconnect,
+	 * so they are only allocated on the first start, or when the
+	 * controls ask for a different layout. A deeper stream than
+	 * before allocates the urbs it is missing as they are submitted.
+	 */
+	smi2021->isoc_target = smi2021->isoc_transfers;
+	if (!smi2021->isoc_ctl.urb ||
+	    smi2021->isoc_ctl.num_packets != smi2021->isoc_packets) {
 		rc = smi2021_alloc_isoc(smi2021);
 		if (rc < 0)
 			goto err_stop_hw;
 	}
 
-	for (i = 0; i < smi2021->isoc_ctl.num_bufs; i++) {
-		rc = usb_submit_urb(smi2021->isoc_ctl.urb[i], GFP_KERNEL);
-		if (rc) {
-			dev_err(smi2021->dev, "cannot submit urb[%d] (%d)\n",
-									i, rc);
-			goto err_uninit;
-		}
-	}
+	smi2021_reset_sync(smi2021);
+	smi2021->field = -1;
+	smi2021->isoc_ctl.ring_high_water = 0;
+	smi2021->isoc_ctl.ring_overruns = 0;
+	smi2021->isoc_ctl.late_count = 0;
+	smi2021->isoc_ctl.resubmit_failures = 0;
+	smi2021->isoc_ctl.resizes = 0;
+	smi2021->isoc_ctl.adapt_events = 0;
+	smi2021->isoc_ctl.adapt_idle = 0;
+	smi2021->isoc_ctl.adapt_busy = 0;
+	smi2021->isoc_ctl.adapt_floor = 0;
+	smi2021->isoc_ctl.adapt_next = jiffies + HZ;
+	smi2021->isoc_ctl.ts_valid = false;
+
+	rc = smi2021_submit_isoc(smi2021);
+	if (rc)
+		goto err_uninit;
+
+	v4l2_ctrl_grab(smi2021->isoc_packets_ctrl, true);
+	smi2021->streaming = true;
+	smi2021->stream_users = 1;
 
 	/* I have no idea about what this register does with this value. */
 	smi2021_set_reg(smi2021, 0, 0x1800, 0x0d);
@@ -980,7 +2288,7 @@ err_uninit:
 	smi2021_uninit_isoc(smi2021);
 err_stop_hw:
 	usb_set_interface(smi2021->udev, 0, 0);
-	smi2021_clear_queue(smi2021);
+	smi2021_clear_vq(smi2021, vq);
 
 start_fail:
 	mutex_unlock(&smi2021->v4l2_lock);
@@ -1001,19 +2309,46 @@ static void smi2021_stop_hw(struct smi2021 *smi2021)
 	usb_set_interface(smi2021->udev, 0, 0);
 }
 
-int smi2021_stop(struct smi2021 *smi2021)
+int smi2021_stop(struct smi2021 *smi2021, struct vb2_queue *vq)
 {
 	if (!smi2021->udev)
 		return -ENODEV;
 
+	/* The resize work takes v4l2_lock, so it must be done first */
+	cancel_work_sync(&smi2021->isoc_resize_work);
+
 	if (mutex_lock_interruptible(&smi2021->v4l2_lock))
 		return -ERESTARTSYS;
 
+	if (--smi2021->stream_users) {
+		/*
+		 * The other node keeps streaming, so the transfers and the
+		 * sync state stay. The buffers of this queue are returned
+		 * between two urbs, while the parser doesn't use them.
+		 */
+		mutex_lock(&smi2021->parse_lock);
+		smi2021_clear_vq(smi2021, vq);
+		mutex_unlock(&smi2021->parse_lock);
+		mutex_unlock(&smi2021->v4l2_lock);
+		return 0;
+	}
+
+	smi2021->streaming = false;
+	v4l2_ctrl_grab(smi2021->isoc_packets_ctrl, false);
+
 	smi2021_cancel_isoc(smi2021);
 
+	dev_notice(smi2021->dev, "isoc ring high-water mark %u of %d, %u overruns, %u late, %u resubmit failures, %u resizes\n",
+			smi2021->isoc_ctl.ring_high_water,
+			smi2021->isoc_ctl.num_bufs,
+			smi2021->isoc_ctl.ring_overruns,
+			smi2021->isoc_ctl.late_count,
+			smi2021->isoc_ctl.resubmit_failures,
+			smi2021->isoc_ctl.resizes);
+
 	smi2021_stop_hw(smi2021);
 
-	smi2021_clear_queue(smi2021);
+	smi2021_clear_vq(smi2021, vq);
 
 	dev_notice(smi2021->dev, "streaming stopped\n");
 
@@ -1033,6 +2368,7 @@ static void smi2021_release(struct v4l2_device *v4l2_dev)
 	v4l2_device_unregister(&smi2021->v4l2_dev);
 
 	vb2_queue_release(&smi2021->vb_vidq);
+	vb2_queue_release(&smi2021->vb_vbiq);
 
 	kfree(smi2021);
 
@@ -1184,6 +2520,16 @@ static int smi2021_usb_probe(struct usb_interface *intf,
 	spin_lock_init(&smi2021->buf_lock);
 	mutex_init(&smi2021->v4l2_lock);
 	mutex_init(&smi2021->vb_queue_lock);
+	mutex_init(&smi2021->vbi_queue_lock);
+	mutex_init(&smi2021->parse_lock);
+
+	/* isoc transfers are parsed outside of the completion handler */
+	INIT_WORK(&smi2021->isoc_work, smi2021_isoc_work);
+	INIT_WORK(&smi2021->isoc_resize_work, smi2021_isoc_resize_work);
+	smi2021->pool_home = smi2021_pool_home();
+	smi2021->pool_hint = -1;
+	smi2021->pool_queued = -1;
+	smi2021->pool_running = -1;
 
 	rc = smi2021_vb2_setup(smi2021);
 	if (rc < 0) {
@@ -1191,12 +2537,32 @@ static int smi2021_usb_probe(struct usb_interface *intf,
 		goto free_err;
 	}
 
-	rc = v4l2_ctrl_handler_init(&smi2021->ctrl_handler, 0);
+	rc = v4l2_ctrl_handler_init(&smi2021->ctrl_handler, 6);
 	if (rc < 0) {
 		dev_err(dev, "Could not initialize v4l2 ctrl handler\n");
 		goto free_err;
 	}
 
+	v4l2_ctrl_new_custom(&smi2021->ctrl_handler,
+				&smi2021_ctrl_isoc_transfers, NULL);
+	smi2021->isoc_packets_ctrl = v4l2_ctrl_new_custom(
+				&smi2021->ctrl_handler,
+				&smi2021_ctrl_isoc_packets, NULL);
+	v4l2_ctrl_new_custom(&smi2021->ctrl_handler,
+				&smi2021_ctrl_isoc_adaptive, NULL);
+	v4l2_ctrl_new_custom(&smi2021->ctrl_handler,
+				&smi2021_ctrl_progress_lines, NULL);
+	v4l2_ctrl_new_custom(&smi2021->ctrl_handler,
+				&smi2021_ctrl_repeat_frame, NULL);
+	v4l2_ctrl_new_custom(&smi2021->ctrl_handler,
+				&smi2021_ctrl_processing_cpu, NULL);
+	rc = smi2021->ctrl_handler.error;
+	if (rc < 0) {
+		dev_err(dev, "Could not add v4l2 controls\n");
+		goto free_ctrl;
+	}
+	v4l2_ctrl_handler_setup(&smi2021->ctrl_handler);
+
 	/* v4l2 struct */
 	smi2021->v4l2_dev.release = smi2021_release;
 	smi2021->v4l2_dev.ctrl_handler = &smi2021->ctrl_handler;
@@ -1208,13 +2574,6 @@ static int smi2021_usb_probe(struct usb_interface *intf,
 
 
 	smi2021_initialize(smi2021);
-	smi2021->skip_frame = false;
-	smi2021->skip_frame_odd = false;
-
-	smi2021->blk_line_start_recheck = 0;
-	smi2021->blk_line_read = 0;
-	smi2021->to_blk_line_end = SMI2021_BYTES_PER_LINE;
-
 	/* i2c adapter */
 	smi2021->i2c_adap = adap_template;
 
@@ -1271,6 +2630,11 @@ static int smi2021_usb_probe(struct usb_interface *intf,
 	/* NTSC is default */
 	smi2021->cur_norm = V4L2_STD_NTSC;
 	smi2021->cur_height = SMI2021_NTSC_LINES;
+	smi2021->cur_field = V4L2_FIELD_INTERLACED;
+	smi2021->cur_pixelformat = V4L2_PIX_FMT_UYVY;
+	smi2021->cur_pixel_skip = 1;
+	smi2021->cur_line_skip = 1;
+	smi2021_reset_crop(smi2021);
 	v4l2_subdev_call(smi2021->gm7113c_subdev, video, s_std,
 			smi2021->cur_norm);
 	v4l2_subdev_call(smi2021->gm7113c_subdev, video, s_routing,
@@ -1287,6 +2651,11 @@ static int smi2021_usb_probe(struct usb_interface *intf,
 
 	smi2021_snd_register(smi2021);
 
+	smi2021->debugfs_dir = debugfs_create_dir(dev_name(dev),
+						smi2021_debugfs_root);
+	debugfs_create_file("stats", 0444, smi2021->debugfs_dir, smi2021,
+						&smi2021_stats_fops);
+
 	return 0;
 
 unreg_i2c:
@@ -1315,18 +2684,27 @@ static void smi2021_usb_disconnect(struct usb_interface *intf)
 	usb_set_interface(udev, 0, 0);
 	usb_set_intfdata(intf, NULL);
 
+	debugfs_remove_recursive(smi2021->debugfs_dir);
+	cancel_work_sync(&smi2021->isoc_resize_work);
+
 	mutex_lock(&smi2021->vb_queue_lock);
+	mutex_lock(&smi2021->vbi_queue_lock);
 	mutex_lock(&smi2021->v4l2_lock);
 
+	smi2021->streaming = false;
+
 	smi2021_uninit_isoc(smi2021);
 	smi2021_clear_queue(smi2021);
+	smi2021_clear_vbi_queue(smi2021);
 
+	video_unregister_device(&smi2021->vbi_dev);
 	video_unregister_device(&smi2021->vdev);
 	v4l2_device_disconnect(&smi2021->v4l2_dev);
 
 	smi2021->udev = NULL;
 
 	mutex_unlock(&smi2021->v4l2_lock);
+	mutex_unlock(&smi2021->vbi_queue_lock);
 	mutex_unlock(&smi2021->vb_queue_lock);
 
 	smi2021_snd_unregister(smi2021);
@@ -1350,4 +2728,46 @@ struct usb_driver smi2021_usb_driver = {
 	.disconnect = smi2021_usb_disconnect
 };
 
-module_usb_driver(smi2021_usb_driver);
+static int __init smi2021_init(void)
+{
+	int rc;
+
+	smi2021_pool = alloc_percpu(struct smi2021_pool_cpu);
+	if (!smi2021_pool)
+		return -ENOMEM;
+
+	smi2021_pool_wq = alloc_workqueue("smi2021", WQ_HIGHPRI, 0);
+	if (!smi2021_pool_wq) {
+		rc = -ENOMEM;
+		goto free_pool;
+	}
+
+	smi2021_debugfs_root = debugfs_create_dir("smi2021", NULL);
+	debugfs_create_file("pool", 0444, smi2021_debugfs_root, NULL,
+						&smi2021_pool_fops);
+
+	rc = usb_register(&smi2021_usb_driver);
+	if (rc)
+		goto free_wq;
+
+	return 0;
+
+free_wq:
+	debugfs_remove_recursive(smi2021_debugfs_root);
+	destroy_workqueue(smi2021_pool_wq);
+free_pool:
+	free_percpu(smi2021_pool);
+
+	return rc;
+}
+
+static void __exit smi2021_exit(void)
+{
+	usb_deregister(&smi2021_usb_driver);
+	debugfs_remove_recursive(smi2021_debugfs_root);
+	destroy_workqueue(smi2021_pool_wq);
+	free_percpu(smi2021_pool);
+}
+
+module_init(smi2021_init);
+module_exit(smi2021_exit);
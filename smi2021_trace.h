@@ -0,0 +1,177 @@
+/************************************************************************
+ * smi2021_trace.h							*
+ *									*
+ * USB Driver for SMI2021 - EasyCap					*
+ * **********************************************************************
+ *
+ * Copyright 2011-2013 Jon Arne Jørgensen
+ * <jonjon.arnearne--a.t--gmail.com>
+ *
+ * Copyright 2011, 2012 Tony Brown, Michal Demin, Jeffry Johnston
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM smi2021
+
+#if !defined(SMI2021_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SMI2021_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* An urb completed, and was handed to the worker unless dropped */
+TRACE_EVENT(smi2021_urb_done,
+	TP_PROTO(u32 seq, int start_frame, int packets, int errors,
+		 u64 start_ns, bool dropped),
+	TP_ARGS(seq, start_frame, packets, errors, start_ns, dropped),
+
+	TP_STRUCT__entry(
+		__field(u32, seq)
+		__field(int, start_frame)
+		__field(int, packets)
+		__field(int, errors)
+		__field(u64, start_ns)
+		__field(bool, dropped)
+	),
+
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->start_frame = start_frame;
+		__entry->packets = packets;
+		__entry->errors = errors;
+		__entry->start_ns = start_ns;
+		__entry->dropped = dropped;
+	),
+
+	TP_printk("urb %u frame %d packets %d errors %d start %llu%s",
+		  __entry->seq, __entry->start_frame, __entry->packets,
+		  __entry->errors, __entry->start_ns,
+		  __entry->dropped ? " dropped" : "")
+);
+
+/* The worker is done with the data of an urb */
+TRACE_EVENT(smi2021_urb_parsed,
+	TP_PROTO(u32 seq, unsigned int bytes),
+	TP_ARGS(seq, bytes),
+
+	TP_STRUCT__entry(
+		__field(u32, seq)
+		__field(unsigned int, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->seq = seq;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("urb %u bytes %u", __entry->seq, __entry->bytes)
+);
+
+TRACE_EVENT(smi2021_trc,
+	TP_PROTO(u8 trc),
+	TP_ARGS(trc),
+
+	TP_STRUCT__entry(
+		__field(u8, trc)
+	),
+
+	TP_fast_assign(
+		__entry->trc = trc;
+	),
+
+	TP_printk("%s field %d%s",
+		  __entry->trc & 0x10 ? "EAV" : "SAV",
+		  __entry->trc & 0x40 ? 2 : 1,
+		  __entry->trc & 0x20 ? " vbi" : "")
+);
+
+DECLARE_EVENT_CLASS(smi2021_field,
+	TP_PROTO(int sequence, bool field2),
+	TP_ARGS(sequence, field2),
+
+	TP_STRUCT__entry(
+		__field(int, sequence)
+		__field(bool, field2)
+	),
+
+	TP_fast_assign(
+		__entry->sequence = sequence;
+		__entry->field2 = field2;
+	),
+
+	TP_printk("sequence %d field %d",
+		  __entry->sequence, __entry->field2 ? 2 : 1)
+);
+
+/* The first active line of a field */
+DEFINE_EVENT(smi2021_field, smi2021_field_start,
+	TP_PROTO(int sequence, bool field2),
+	TP_ARGS(sequence, field2)
+);
+
+/* The last line of a field we capture is in the buffer */
+DEFINE_EVENT(smi2021_field, smi2021_field_end,
+	TP_PROTO(int sequence, bool field2),
+	TP_ARGS(sequence, field2)
+);
+
+TRACE_EVENT(smi2021_buf_done,
+	TP_PROTO(unsigned int index, int sequence, u64 timestamp,
+		 bool error),
+	TP_ARGS(index, sequence, timestamp, error),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, index)
+		__field(int, sequence)
+		__field(u64, timestamp)
+		__field(bool, error)
+	),
+
+	TP_fast_assign(
+		__entry->index = index;
+		__entry->sequence = sequence;
+		__entry->timestamp = timestamp;
+		__entry->error = error;
+	),
+
+	TP_printk("index %u sequence %d timestamp %llu%s",
+		  __entry->index, __entry->sequence, __entry->timestamp,
+		  __entry->error ? " error" : "")
+);
+
+TRACE_EVENT(smi2021_audio_period,
+	TP_PROTO(unsigned int write_ptr),
+	TP_ARGS(write_ptr),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, write_ptr)
+	),
+
+	TP_fast_assign(
+		__entry->write_ptr = write_ptr;
+	),
+
+	TP_printk("write_ptr %u", __entry->write_ptr)
+);
+
+#endif /* SMI2021_TRACE_H */
+
+/* This part must be outside the multi-read protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE smi2021_trace
+#include <trace/define_trace.h>
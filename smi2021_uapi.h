@@ -0,0 +1,73 @@
+/************************************************************************
+ * smi2021_uapi.h							*
+ *									*
+ * USB Driver for SMI2021 - EasyCap					*
+ * **********************************************************************
+ *
+ * Copyright 2011-2013 Jon Arne Jørgensen
+ * <jonjon.arnearne--a.t--gmail.com>
+ *
+ * Copyright 2011, 2012 Tony Brown, Michal Demin, Jeffry Johnston
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The private controls and events of the driver, and the payloads of
+ * the events. This only uses the userspace types, so applications can
+ * include it as it is.
+ */
+
+#ifndef SMI2021_UAPI_H
+#define SMI2021_UAPI_H
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/* Private controls */
+#define SMI2021_CID_ISOC_TRANSFERS	(V4L2_CID_USER_BASE | 0xf000)
+#define SMI2021_CID_ISOC_PACKETS	(V4L2_CID_USER_BASE | 0xf001)
+#define SMI2021_CID_ISOC_ADAPTIVE	(V4L2_CID_USER_BASE | 0xf002)
+#define SMI2021_CID_PROGRESS_LINES	(V4L2_CID_USER_BASE | 0xf003)
+#define SMI2021_CID_REPEAT_FRAME	(V4L2_CID_USER_BASE | 0xf004)
+#define SMI2021_CID_PROCESSING_CPU	(V4L2_CID_USER_BASE | 0xf005)
+
+/* Private events */
+#define SMI2021_EVENT_PROGRESS		(V4L2_EVENT_PRIVATE_START + 1)
+#define SMI2021_EVENT_REPEAT		(V4L2_EVENT_PRIVATE_START + 2)
+
+/*
+ * Payload of SMI2021_EVENT_PROGRESS, sent every "Progress Lines" lines
+ * while a buffer is being filled, so userspace can start working on
+ * the top of a picture before the whole of it has arrived.
+ */
+struct smi2021_event_progress {
+	__u32 index;		/* vb2 index of the buffer being filled */
+	__u32 sequence;		/* sequence number it will be given */
+	__u32 lines;		/* lines valid from the top of the buffer */
+	__u32 field;		/* field being received, TOP or BOTTOM */
+};
+
+/*
+ * Payload of SMI2021_EVENT_REPEAT, sent with "Repeat Last Frame" on
+ * for a buffer filled with a frame that was captured while userspace
+ * had no buffers queued, instead of with a new one.
+ */
+struct smi2021_event_repeat {
+	__u32 index;		/* vb2 index of the buffer */
+	__u32 sequence;		/* sequence number of the frame in it */
+};
+
+#endif /* SMI2021_UAPI_H */
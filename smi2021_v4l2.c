@@ -47,14 +47,21 @@ static int vidioc_querycap(struct file *file, void *priv,
 			struct v4l2_capability *cap)
 {
 	struct smi2021 *smi2021 = video_drvdata(file);
+	struct video_device *vdev = video_devdata(file);
 
 	strlcpy(cap->driver, "smi2021", sizeof(cap->driver));
 	strlcpy(cap->card, "smi2021", sizeof(cap->card));
 	usb_make_path(smi2021->udev, cap->bus_info, sizeof(cap->bus_info));
-	cap->device_caps = V4L2_CAP_VIDEO_CAPTURE |
-			   V4L2_CAP_STREAMING |
-			   V4L2_CAP_READWRITE;
-	cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+	if (vdev->vfl_type == VFL_TYPE_VBI)
+		cap->device_caps = V4L2_CAP_VBI_CAPTURE |
+				   V4L2_CAP_SLICED_VBI_CAPTURE;
+	else
+		cap->device_caps = V4L2_CAP_VIDEO_CAPTURE;
+	cap->device_caps |= V4L2_CAP_STREAMING | V4L2_CAP_READWRITE;
+	cap->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VBI_CAPTURE |
+			    V4L2_CAP_SLICED_VBI_CAPTURE |
+			    V4L2_CAP_STREAMING | V4L2_CAP_READWRITE |
+			    V4L2_CAP_DEVICE_CAPS;
 	return 0;
 }
 
@@ -72,31 +79,337 @@ static int vidioc_enum_input(struct file *file, void *priv,
 	return 0;
 }
 
+/* The device sends UYVY, the others are converted while copying */
+static const struct smi2021_fmt smi2021_formats[] = {
+	{
+		.name = "16 bpp YUY2, 4:2:2, packed",
+		.fourcc = V4L2_PIX_FMT_UYVY,
+		.depth = 16,
+	}, {
+		.name = "16 bpp YUYV, 4:2:2, packed",
+		.fourcc = V4L2_PIX_FMT_YUYV,
+		.depth = 16,
+	}, {
+		.name = "16 bpp Y/CbCr 4:2:2, semi planar",
+		.fourcc = V4L2_PIX_FMT_NV16,
+		.depth = 16,
+		.planar = true,
+	}, {
+		.name = "12 bpp Y/CbCr 4:2:0, semi planar",
+		.fourcc = V4L2_PIX_FMT_NV12,
+		.depth = 12,
+		.planar = true,
+	}, {
+		.name = "8 bpp Greyscale",
+		.fourcc = V4L2_PIX_FMT_GREY,
+		.depth = 8,
+	},
+};
+
+static const struct smi2021_fmt *smi2021_find_format(u32 fourcc)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(smi2021_formats); i++)
+		if (smi2021_formats[i].fourcc == fourcc)
+			return &smi2021_formats[i];
+
+	return &smi2021_formats[0];
+}
+
 static int vidioc_enum_fmt_vid_cap(struct file *file, void *priv,
 			struct v4l2_fmtdesc *f)
 {
-	if (f->index != 0)
+	if (f->index >= ARRAY_SIZE(smi2021_formats))
 		return -EINVAL;
 
-	strlcpy(f->description, "16 bpp YUY2, 4:2:2, packed",
+	strlcpy(f->description, smi2021_formats[f->index].name,
 					sizeof(f->description));
-	f->pixelformat = V4L2_PIX_FMT_UYVY;
+	f->pixelformat = smi2021_formats[f->index].fourcc;
+	return 0;
+}
+
+/*
+ * Sizes are the crop size divided by 1, 2 or 4 in each direction,
+ * index 0-2 are the widths at full height, 3-5 at half height and
+ * 6-8 at quarter height.
+ */
+#define SMI2021_FRAME_SIZES	9
+
+static int vidioc_enum_framesizes(struct file *file, void *priv,
+			struct v4l2_frmsizeenum *fsize)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	if (fsize->index >= SMI2021_FRAME_SIZES)
+		return -EINVAL;
+
+	if (smi2021_find_format(fsize->pixel_format)->fourcc !=
+						fsize->pixel_format)
+		return -EINVAL;
+
+	fsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+	fsize->discrete.width = smi2021->cur_crop.width >> fsize->index % 3;
+	fsize->discrete.height = smi2021->cur_crop.height >> fsize->index / 3;
+	return 0;
+}
+
+/* Pick the divisor giving the size closest to the one asked for */
+static int smi2021_decimation(int full, int size)
+{
+	if (size > full * 3 / 4)
+		return 1;
+	if (size > full * 3 / 8)
+		return 2;
+	return 4;
+}
+
+/*
+ * Fill in the format for the current standard, keeping the pixel
+ * format and field order from pix if we support them and rounding
+ * the size to the nearest one we can decimate to.
+ */
+static void smi2021_try_pix_format(struct smi2021 *smi2021,
+				struct v4l2_pix_format *pix)
+{
+	const struct smi2021_fmt *fmt = smi2021_find_format(pix->pixelformat);
+	const struct v4l2_rect *crop = &smi2021->cur_crop;
+	int vdec = smi2021_decimation(crop->height, pix->height);
+
+	pix->width = crop->width / smi2021_decimation(crop->width, pix->width);
+	pix->height = crop->height;
+
+	switch (pix->field) {
+	case V4L2_FIELD_ALTERNATE:
+	case V4L2_FIELD_TOP:
+	case V4L2_FIELD_BOTTOM:
+		break;
+	case V4L2_FIELD_SEQ_TB:
+	case V4L2_FIELD_INTERLACED:
+		/* Anything smaller than a frame comes from a single field */
+		if (vdec > 1)
+			pix->field = V4L2_FIELD_TOP;
+		break;
+	default:
+		pix->field = vdec > 1 ? V4L2_FIELD_TOP : V4L2_FIELD_INTERLACED;
+	}
+
+	/* Single fields may skip lines as well */
+	if (pix->field != V4L2_FIELD_INTERLACED &&
+	    pix->field != V4L2_FIELD_SEQ_TB)
+		pix->height /= max(vdec, 2);
+
+	pix->pixelformat = fmt->fourcc;
+	if (fmt->planar)
+		pix->bytesperline = pix->width;
+	else
+		pix->bytesperline = pix->width * fmt->depth / 8;
+	pix->sizeimage = pix->width * pix->height * fmt->depth / 8;
+	pix->colorspace = V4L2_COLORSPACE_SMPTE170M;
+	pix->priv = 0;
+}
+
+/* The format we capture with the current settings */
+static void smi2021_cur_pix_format(struct smi2021 *smi2021,
+				struct v4l2_pix_format *pix)
+{
+	pix->pixelformat = smi2021->cur_pixelformat;
+	pix->field = smi2021->cur_field;
+	pix->width = smi2021->cur_crop.width / smi2021->cur_pixel_skip;
+	pix->height = smi2021->cur_crop.height;
+	if (smi2021->cur_field != V4L2_FIELD_INTERLACED &&
+	    smi2021->cur_field != V4L2_FIELD_SEQ_TB)
+		pix->height /= 2 * smi2021->cur_line_skip;
+
+	smi2021_try_pix_format(smi2021, pix);
+}
+
+static unsigned int smi2021_image_size(struct smi2021 *smi2021)
+{
+	struct v4l2_pix_format pix;
+
+	smi2021_cur_pix_format(smi2021, &pix);
+	return pix.sizeimage;
+}
+
+static int vidioc_g_fmt_vid_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	smi2021_cur_pix_format(smi2021, &f->fmt.pix);
+	return 0;
+}
+
+static int vidioc_try_fmt_vid_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	smi2021_try_pix_format(smi2021, &f->fmt.pix);
+	return 0;
+}
+
+static int vidioc_s_fmt_vid_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+	struct v4l2_pix_format *pix = &f->fmt.pix;
+	int pixel_skip, line_skip = 1;
+
+	smi2021_try_pix_format(smi2021, pix);
+
+	pixel_skip = smi2021->cur_crop.width / pix->width;
+	if (pix->height < smi2021->cur_crop.height)
+		line_skip = smi2021->cur_crop.height / 2 / pix->height;
+
+	if (pix->pixelformat == smi2021->cur_pixelformat &&
+	    pix->field == smi2021->cur_field &&
+	    pixel_skip == smi2021->cur_pixel_skip &&
+	    line_skip == smi2021->cur_line_skip)
+		return 0;
+
+	if (vb2_is_busy(&smi2021->vb_vidq))
+		return -EBUSY;
+
+	smi2021->cur_pixelformat = pix->pixelformat;
+	smi2021->cur_field = pix->field;
+	smi2021->cur_pixel_skip = pixel_skip;
+	smi2021->cur_line_skip = line_skip;
+	return 0;
+}
+
+/* The raw VBI format only depends on the standard */
+static int vidioc_g_fmt_vbi_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+	struct v4l2_vbi_format *vbi = &f->fmt.vbi;
+
+	memset(vbi, 0, sizeof(*vbi));
+	vbi->sampling_rate = SMI2021_VBI_SAMPLING_RATE;
+	vbi->samples_per_line = SMI2021_BYTES_PER_LINE;
+	vbi->sample_format = V4L2_PIX_FMT_GREY;
+
+	if (smi2021->cur_norm & V4L2_STD_525_60) {
+		vbi->offset = SMI2021_NTSC_VBI_OFFSET;
+		vbi->start[0] = SMI2021_NTSC_VBI_START;
+		vbi->start[1] = SMI2021_NTSC_VBI_START + 262;
+		vbi->count[0] = SMI2021_NTSC_VBI_LINES;
+	} else {
+		vbi->offset = SMI2021_PAL_VBI_OFFSET;
+		vbi->start[0] = SMI2021_PAL_VBI_START;
+		vbi->start[1] = SMI2021_PAL_VBI_START + 312;
+		vbi->count[0] = SMI2021_PAL_VBI_LINES;
+	}
+	vbi->count[1] = vbi->count[0];
+
+	return 0;
+}
+
+static int vidioc_s_fmt_vbi_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	if (smi2021->vbi_sliced && vb2_is_busy(&smi2021->vb_vbiq))
+		return -EBUSY;
+
+	smi2021->vbi_sliced = false;
+	smi2021->vb_vbiq.type = V4L2_BUF_TYPE_VBI_CAPTURE;
+	return vidioc_g_fmt_vbi_cap(file, priv, f);
+}
+
+/*
+ * Sliced VBI, the slicer in smi2021_vbi.c does the caption
+ * for 525 lines and the wide screen signalling for 625 lines.
+ */
+static u16 smi2021_sliced_services(struct smi2021 *smi2021)
+{
+	if (smi2021->cur_norm & V4L2_STD_525_60)
+		return V4L2_SLICED_CAPTION_525;
+	return V4L2_SLICED_WSS_625;
+}
+
+static void smi2021_sliced_lines(u16 services, u16 lines[2][24])
+{
+	if (services & V4L2_SLICED_CAPTION_525) {
+		lines[0][SMI2021_CC_LINE] = V4L2_SLICED_CAPTION_525;
+		lines[1][SMI2021_CC_LINE] = V4L2_SLICED_CAPTION_525;
+	}
+	if (services & V4L2_SLICED_WSS_625)
+		lines[0][SMI2021_WSS_LINE] = V4L2_SLICED_WSS_625;
+}
+
+static void smi2021_try_sliced_format(struct smi2021 *smi2021,
+				struct v4l2_sliced_vbi_format *sliced)
+{
+	u16 services = sliced->service_set;
+	int i, j;
+
+	for (i = 0; i < 2; i++)
+		for (j = 0; j < 24; j++)
+			services |= sliced->service_lines[i][j];
+	services &= smi2021_sliced_services(smi2021);
+
+	memset(sliced, 0, sizeof(*sliced));
+	smi2021_sliced_lines(services, sliced->service_lines);
+	sliced->service_set = services;
+	sliced->io_size = 2 * sizeof(struct v4l2_sliced_vbi_data);
+}
+
+static int vidioc_g_fmt_sliced_vbi_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	f->fmt.sliced.service_set = smi2021->vbi_services;
+	memset(f->fmt.sliced.service_lines, 0,
+		sizeof(f->fmt.sliced.service_lines));
+	smi2021_try_sliced_format(smi2021, &f->fmt.sliced);
+	return 0;
+}
+
+static int vidioc_try_fmt_sliced_vbi_cap(struct file *file, void *priv,
+			struct v4l2_format *f)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	smi2021_try_sliced_format(smi2021, &f->fmt.sliced);
 	return 0;
 }
 
-static int vidioc_fmt_vid_cap(struct file *file, void *priv,
+static int vidioc_s_fmt_sliced_vbi_cap(struct file *file, void *priv,
 			struct v4l2_format *f)
 {
 	struct smi2021 *smi2021 = video_drvdata(file);
 
-	f->fmt.pix.width = SMI2021_BYTES_PER_LINE / 2;
-	f->fmt.pix.height = smi2021->cur_height;
-	f->fmt.pix.pixelformat = V4L2_PIX_FMT_UYVY;
-	f->fmt.pix.field = V4L2_FIELD_INTERLACED;
-	f->fmt.pix.bytesperline = SMI2021_BYTES_PER_LINE;
-	f->fmt.pix.sizeimage = f->fmt.pix.height * f->fmt.pix.bytesperline;
-	f->fmt.pix.colorspace = V4L2_COLORSPACE_SMPTE170M;
-	f->fmt.pix.priv = 0;
+	smi2021_try_sliced_format(smi2021, &f->fmt.sliced);
+
+	if (smi2021->vbi_sliced &&
+	    f->fmt.sliced.service_set == smi2021->vbi_services)
+		return 0;
+
+	if (vb2_is_busy(&smi2021->vb_vbiq))
+		return -EBUSY;
+
+	smi2021->vbi_sliced = true;
+	smi2021->vbi_services = f->fmt.sliced.service_set;
+	smi2021->vb_vbiq.type = V4L2_BUF_TYPE_SLICED_VBI_CAPTURE;
+	return 0;
+}
+
+static int vidioc_g_sliced_vbi_cap(struct file *file, void *priv,
+			struct v4l2_sliced_vbi_cap *cap)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	if (cap->type != V4L2_BUF_TYPE_SLICED_VBI_CAPTURE)
+		return -EINVAL;
+
+	memset(cap->service_lines, 0, sizeof(cap->service_lines));
+	cap->service_set = smi2021_sliced_services(smi2021);
+	smi2021_sliced_lines(cap->service_set, cap->service_lines);
 	return 0;
 }
 
@@ -116,6 +429,79 @@ static int vidioc_g_input(struct file *file, void *priv, unsigned int *i)
 	return 0;
 }
 
+/* The whole picture of the current standard */
+static void smi2021_crop_bounds(struct smi2021 *smi2021, struct v4l2_rect *r)
+{
+	r->left = 0;
+	r->top = 0;
+	r->width = SMI2021_BYTES_PER_LINE / 2;
+	r->height = smi2021->cur_height;
+}
+
+void smi2021_reset_crop(struct smi2021 *smi2021)
+{
+	smi2021_crop_bounds(smi2021, &smi2021->cur_crop);
+}
+
+static int vidioc_g_selection(struct file *file, void *priv,
+			struct v4l2_selection *s)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -EINVAL;
+
+	switch (s->target) {
+	case V4L2_SEL_TGT_CROP:
+		s->r = smi2021->cur_crop;
+		return 0;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		smi2021_crop_bounds(smi2021, &s->r);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/*
+ * The crop rectangle is in pixels and frame lines. Its size is kept
+ * to multiples of 8, so it still holds whole pixel pairs and the same
+ * number of lines from both fields after decimating by 4. It starts
+ * on a pixel pair and on a line of the first field.
+ */
+#define SMI2021_CROP_MIN_WIDTH		64
+#define SMI2021_CROP_MIN_HEIGHT		32
+
+static int vidioc_s_selection(struct file *file, void *priv,
+			struct v4l2_selection *s)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+	struct v4l2_rect bounds, r;
+
+	if (s->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+	    s->target != V4L2_SEL_TGT_CROP)
+		return -EINVAL;
+
+	smi2021_crop_bounds(smi2021, &bounds);
+	r.width = clamp_t(u32, s->r.width, SMI2021_CROP_MIN_WIDTH,
+				bounds.width) & ~7;
+	r.height = clamp_t(u32, s->r.height, SMI2021_CROP_MIN_HEIGHT,
+				bounds.height) & ~7;
+	r.left = clamp_t(s32, s->r.left, 0, bounds.width - r.width) & ~1;
+	r.top = clamp_t(s32, s->r.top, 0, bounds.height - r.height) & ~1;
+	s->r = r;
+
+	if (!memcmp(&r, &smi2021->cur_crop, sizeof(r)))
+		return 0;
+
+	if (vb2_is_busy(&smi2021->vb_vidq))
+		return -EBUSY;
+
+	smi2021->cur_crop = r;
+	return 0;
+}
+
 static int vidioc_s_std(struct file *file, void *priv, v4l2_std_id norm)
 {
 	struct smi2021 *smi2021 = video_drvdata(file);
@@ -123,7 +509,7 @@ static int vidioc_s_std(struct file *file, void *priv, v4l2_std_id norm)
 	if (norm == smi2021->cur_norm)
 		return 0;
 
-	if (vb2_is_busy(&smi2021->vb_vidq))
+	if (vb2_is_busy(&smi2021->vb_vidq) || vb2_is_busy(&smi2021->vb_vbiq))
 		return -EBUSY;
 
 	smi2021->cur_norm = norm;
@@ -134,6 +520,7 @@ static int vidioc_s_std(struct file *file, void *priv, v4l2_std_id norm)
 	else
 		return -EINVAL;
 
+	smi2021_reset_crop(smi2021);
 	v4l2_subdev_call(smi2021->gm7113c_subdev, video, s_std,
 			smi2021->cur_norm);
 
@@ -155,13 +542,43 @@ static int vidioc_s_input(struct file *file, void *priv, unsigned int i)
 	return 0;
 }
 
+static int vidioc_log_status(struct file *file, void *priv)
+{
+	struct smi2021 *smi2021 = video_drvdata(file);
+
+	smi2021_log_stats(smi2021);
+	return v4l2_ctrl_log_status(file, priv);
+}
+
+static int vidioc_subscribe_event(struct v4l2_fh *fh,
+			const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case SMI2021_EVENT_PROGRESS:
+	case SMI2021_EVENT_REPEAT:
+		return v4l2_event_subscribe(fh, sub, 4, NULL);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
 static const struct v4l2_ioctl_ops smi2021_ioctl_ops = {
 	.vidioc_querycap		= vidioc_querycap,
 	.vidioc_enum_input		= vidioc_enum_input,
 	.vidioc_enum_fmt_vid_cap	= vidioc_enum_fmt_vid_cap,
-	.vidioc_g_fmt_vid_cap		= vidioc_fmt_vid_cap,
-	.vidioc_try_fmt_vid_cap		= vidioc_fmt_vid_cap,
-	.vidioc_s_fmt_vid_cap		= vidioc_fmt_vid_cap,
+	.vidioc_enum_framesizes		= vidioc_enum_framesizes,
+	.vidioc_g_fmt_vid_cap		= vidioc_g_fmt_vid_cap,
+	.vidioc_try_fmt_vid_cap		= vidioc_try_fmt_vid_cap,
+	.vidioc_s_fmt_vid_cap		= vidioc_s_fmt_vid_cap,
+	.vidioc_g_fmt_vbi_cap		= vidioc_g_fmt_vbi_cap,
+	.vidioc_try_fmt_vbi_cap		= vidioc_g_fmt_vbi_cap,
+	.vidioc_s_fmt_vbi_cap		= vidioc_s_fmt_vbi_cap,
+	.vidioc_g_fmt_sliced_vbi_cap	= vidioc_g_fmt_sliced_vbi_cap,
+	.vidioc_try_fmt_sliced_vbi_cap	= vidioc_try_fmt_sliced_vbi_cap,
+	.vidioc_s_fmt_sliced_vbi_cap	= vidioc_s_fmt_sliced_vbi_cap,
+	.vidioc_g_sliced_vbi_cap	= vidioc_g_sliced_vbi_cap,
+	.vidioc_g_selection		= vidioc_g_selection,
+	.vidioc_s_selection		= vidioc_s_selection,
 	.vidioc_g_std			= vidioc_g_std,
 	.vidioc_s_std			= vidioc_s_std,
 	.vidioc_g_input			= vidioc_g_input,
@@ -169,16 +586,18 @@ static const struct v4l2_ioctl_ops smi2021_ioctl_ops = {
 
 	/* vb2 handle these */
 	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
-/*	.vidioc_prepare_buf		= vb2_ioctl_prepare_buf, */
+	.vidioc_prepare_buf		= vb2_ioctl_prepare_buf,
 	.vidioc_querybuf		= vb2_ioctl_querybuf,
 	.vidioc_qbuf			= vb2_ioctl_qbuf,
 	.vidioc_dqbuf			= vb2_ioctl_dqbuf,
+	.vidioc_expbuf			= vb2_ioctl_expbuf,
 	.vidioc_streamon		= vb2_ioctl_streamon,
 	.vidioc_streamoff		= vb2_ioctl_streamoff,
 
+	.vidioc_subscribe_event		= vidioc_subscribe_event,
+
 	/* v4l2-event and v4l2-ctrl handle these */
-	.vidioc_log_status		= v4l2_ctrl_log_status,
-	.vidioc_subscribe_event		= v4l2_ctrl_subscribe_event,
+	.vidioc_log_status		= vidioc_log_status,
 	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
 };
 
@@ -205,7 +624,7 @@ static int queue_setup(struct vb2_queue *vq,
 	struct smi2021 *smi2021 = vb2_get_drv_priv(vq);
 	*nbuffers = clamp_t(unsigned int, *nbuffers, 4, 16);
 
-	sizes[0] = SMI2021_BYTES_PER_LINE * smi2021->cur_height;
+	sizes[0] = smi2021_image_size(smi2021);
 
 	/* This means a packed colorformat */
 	*nplanes = 1;
@@ -216,6 +635,21 @@ static int queue_setup(struct vb2_queue *vq,
 	return 0;
 }
 
+/*
+ * USERPTR memory and imported DMABUFs can be too small for the format,
+ * or have no kernel mapping to copy into. Refuse those at QBUF time.
+ */
+static int buffer_prepare(struct vb2_buffer *vb)
+{
+	struct smi2021 *smi2021 = vb2_get_drv_priv(vb->vb2_queue);
+
+	if (!vb2_plane_vaddr(vb, 0) ||
+	    vb2_plane_size(vb, 0) < smi2021_image_size(smi2021))
+		return -EINVAL;
+
+	return 0;
+}
+
 static void buffer_queue(struct vb2_buffer *vb)
 {
 	unsigned long flags;
@@ -246,9 +680,10 @@ static void buffer_queue(struct vb2_buffer *vb)
 
 		/*
 		 * If the buffer length is less than expected,
+		 * or we have no kernel mapping to copy into,
 		 * we return the buffer back to userspace
 		 */
-		if (buf->length < SMI2021_BYTES_PER_LINE * smi2021->cur_height)
+		if (!buf->mem || buf->length < smi2021_image_size(smi2021))
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 			vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
 #else
@@ -260,20 +695,94 @@ static void buffer_queue(struct vb2_buffer *vb)
 	spin_unlock_irqrestore(&smi2021->buf_lock, flags);
 }
 
+/*
+ * Work out where each line of each field goes in the buffer.
+ * The format can't change while streaming, so this is done once.
+ */
+static void smi2021_set_geometry(struct smi2021 *smi2021)
+{
+	const struct v4l2_rect *crop = &smi2021->cur_crop;
+	int lines, height;
+
+	smi2021->sizeimage = smi2021_image_size(smi2021);
+	smi2021->width = crop->width / smi2021->cur_pixel_skip;
+
+	/* The field is complete once the last line of the crop is in */
+	smi2021->crop_top = crop->top / 2;
+	smi2021->field_lines = (crop->top + crop->height) / 2;
+	smi2021->crop_start = crop->left * 2;
+	smi2021->crop_end = (crop->left + crop->width) * 2;
+
+	/* Lines of each field that make it into the buffer */
+	lines = crop->height / 2 / smi2021->cur_line_skip;
+
+	switch (smi2021->cur_field) {
+	case V4L2_FIELD_ALTERNATE:
+	case V4L2_FIELD_TOP:
+	case V4L2_FIELD_BOTTOM:
+		/* One field per buffer */
+		smi2021->line_step = 1;
+		smi2021->field_offset = 0;
+		smi2021->chroma_offset = 0;
+		height = lines;
+		break;
+	case V4L2_FIELD_SEQ_TB:
+		/* Field 2 follows field 1 */
+		smi2021->line_step = 1;
+		smi2021->field_offset = lines;
+		smi2021->chroma_offset = lines / 2;
+		height = 2 * lines;
+		break;
+	case V4L2_FIELD_INTERLACED:
+	default:
+		/* Field 2 is woven in between the lines of field 1 */
+		smi2021->line_step = 2;
+		smi2021->field_offset = 1;
+		smi2021->chroma_offset = 1;
+		height = 2 * lines;
+	}
+
+	/* The chroma plane of the semi planar formats follows the luma */
+	smi2021->luma_size = height * smi2021->width;
+}
+
 static int start_streaming(struct vb2_queue *vq, unsigned int count)
 {
 	struct smi2021 *smi2021 = vb2_get_drv_priv(vq);
-	return smi2021_start(smi2021);
+	void *scratch;
+	int rc;
+
+	/* Without it frames are dropped while there are no buffers */
+	scratch = vmalloc(smi2021_image_size(smi2021));
+
+	/* The parser may be running for the vbi node already */
+	mutex_lock(&smi2021->parse_lock);
+	smi2021_set_geometry(smi2021);
+	smi2021->scratch.mem = scratch;
+	smi2021->vid_live = true;
+	mutex_unlock(&smi2021->parse_lock);
+
+	rc = smi2021_start(smi2021, vq);
+	if (rc < 0) {
+		mutex_lock(&smi2021->parse_lock);
+		smi2021->vid_live = false;
+		vfree(smi2021->scratch.mem);
+		smi2021->scratch.mem = NULL;
+		mutex_unlock(&smi2021->parse_lock);
+	}
+
+	return rc;
 }
 
 static void stop_streaming(struct vb2_queue *vq)
 {
 	struct smi2021 *smi2021 = vb2_get_drv_priv(vq);
-	smi2021_stop(smi2021);
+	smi2021_stop(smi2021, vq);
 }
 
 static struct vb2_ops smi2021_video_qops = {
 	.queue_setup		= queue_setup,
+	.buf_prepare		= buffer_prepare,
 	.buf_queue		= buffer_queue,
 	.start_streaming	= start_streaming,
 	.stop_streaming		= stop_streaming,
@@ -281,6 +790,152 @@ static struct vb2_ops smi2021_video_qops = {
 	.wait_finish		= vb2_ops_wait_finish,
 };
 
+/*
+ * Lines from the start of each field that go through the VBI path,
+ * when slicing up to the last line that may carry a service.
+ */
+static unsigned int smi2021_vbi_lines(struct smi2021 *smi2021)
+{
+	if (smi2021->cur_norm & V4L2_STD_525_60) {
+		if (smi2021->vbi_sliced)
+			return SMI2021_CC_LINE - SMI2021_NTSC_VBI_START + 2;
+		return SMI2021_NTSC_VBI_LINES;
+	}
+
+	if (smi2021->vbi_sliced)
+		return SMI2021_WSS_LINE - SMI2021_PAL_VBI_START + 1;
+	return SMI2021_PAL_VBI_LINES;
+}
+
+static unsigned int smi2021_vbi_size(struct smi2021 *smi2021)
+{
+	/* One entry for each field */
+	if (smi2021->vbi_sliced)
+		return 2 * sizeof(struct v4l2_sliced_vbi_data);
+	return 2 * smi2021_vbi_lines(smi2021) * SMI2021_BYTES_PER_LINE;
+}
+
+/*
+ * Videobuf2 operations for the VBI queue
+ */
+static int vbi_queue_setup(struct vb2_queue *vq,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+			const struct v4l2_format *v4l2_fmt,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+			const void *parg,
+#endif
+			unsigned int *nbuffers, unsigned int *nplanes,
+			unsigned int sizes[],
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+			void *alloc_ctxs[]
+#else
+			struct device *alloc_devs[]
+#endif
+			)
+{
+	struct smi2021 *smi2021 = vb2_get_drv_priv(vq);
+	*nbuffers = clamp_t(unsigned int, *nbuffers, 4, 16);
+
+	sizes[0] = smi2021_vbi_size(smi2021);
+	*nplanes = 1;
+
+	return 0;
+}
+
+static int vbi_buffer_prepare(struct vb2_buffer *vb)
+{
+	struct smi2021 *smi2021 = vb2_get_drv_priv(vb->vb2_queue);
+
+	if (!vb2_plane_vaddr(vb, 0) ||
+	    vb2_plane_size(vb, 0) < smi2021_vbi_size(smi2021))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void vbi_buffer_queue(struct vb2_buffer *vb)
+{
+	unsigned long flags;
+	struct smi2021 *smi2021 = vb2_get_drv_priv(vb->vb2_queue);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+	struct smi2021_buf *buf = container_of(vb, struct smi2021_buf, vb);
+#else
+	struct smi2021_buf *buf = container_of(vb, struct smi2021_buf, vb.vb2_buf);
+#endif
+	buf->mem = vb2_plane_vaddr(vb, 0);
+	buf->length = vb2_plane_size(vb, 0);
+	buf->pos = 0;
+	buf->odd = false;
+
+	spin_lock_irqsave(&smi2021->buf_lock, flags);
+	if (!smi2021->udev || !buf->mem ||
+	    buf->length < smi2021_vbi_size(smi2021))
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
+#else
+		vb2_buffer_done(&buf->vb.vb2_buf, VB2_BUF_STATE_ERROR);
+#endif
+	else
+		list_add_tail(&buf->list, &smi2021->avail_vbi_bufs);
+	spin_unlock_irqrestore(&smi2021->buf_lock, flags);
+}
+
+static int vbi_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct smi2021 *smi2021 = vb2_get_drv_priv(vq);
+	struct v4l2_vbi_format vbi = {
+		.sampling_rate = SMI2021_VBI_SAMPLING_RATE,
+		.samples_per_line = SMI2021_BYTES_PER_LINE,
+		.sample_format = V4L2_PIX_FMT_GREY,
+	};
+	int rc;
+
+	/*
+	 * Have the decoder send the raw samples in the blanking lines,
+	 * the sliced services are sliced from them by the driver.
+	 */
+	v4l2_subdev_call(smi2021->gm7113c_subdev, vbi, s_raw_fmt, &vbi);
+
+	/* The parser may be running for the video node already */
+	mutex_lock(&smi2021->parse_lock);
+	smi2021->vbi_lines = smi2021_vbi_lines(smi2021);
+	smi2021->vbi_services &= smi2021_sliced_services(smi2021);
+	smi2021->vbi_live = true;
+	mutex_unlock(&smi2021->parse_lock);
+
+	rc = smi2021_start(smi2021, vq);
+	if (rc < 0) {
+		mutex_lock(&smi2021->parse_lock);
+		smi2021->vbi_live = false;
+		mutex_unlock(&smi2021->parse_lock);
+	}
+
+	return rc;
+}
+
+static void vbi_stop_streaming(struct vb2_queue *vq)
+{
+	struct smi2021 *smi2021 = vb2_get_drv_priv(vq);
+	struct v4l2_sliced_vbi_format sliced = { 0 };
+
+	smi2021_stop(smi2021, vq);
+
+	/* Give the blanking lines back to the video path */
+	if (smi2021->udev)
+		v4l2_subdev_call(smi2021->gm7113c_subdev, vbi, s_sliced_fmt,
+					&sliced);
+}
+
+static struct vb2_ops smi2021_vbi_qops = {
+	.queue_setup		= vbi_queue_setup,
+	.buf_prepare		= vbi_buffer_prepare,
+	.buf_queue		= vbi_buffer_queue,
+	.start_streaming	= vbi_start_streaming,
+	.stop_streaming		= vbi_stop_streaming,
+	.wait_prepare		= vb2_ops_wait_prepare,
+	.wait_finish		= vb2_ops_wait_finish,
+};
+
 /* Could possibly use V4L2_STD_ALL */
 static struct video_device v4l_template = {
 	.name			= "smi2021",
@@ -292,19 +947,18 @@ static struct video_device v4l_template = {
 
 /*****************************************************************************/
 
-/* Must be called with both v4l2_lock and vb_queue_lock held */
-void smi2021_clear_queue(struct smi2021 *smi2021)
+/* The parser must be stopped or parse_lock held, so it lets go of *cur */
+static void smi2021_return_bufs(struct smi2021 *smi2021,
+				struct list_head *bufs,
+				struct smi2021_buf **cur)
 {
 	struct smi2021_buf *buf;
 	unsigned long flags;
 
-	dev_info(smi2021->dev, "clear_queue called\n");
-
 	/* Release all active buffers */
 	spin_lock_irqsave(&smi2021->buf_lock, flags);
-	while (!list_empty(&smi2021->avail_bufs)) {
-		buf = list_first_entry(&smi2021->avail_bufs,
-				struct smi2021_buf, list);
+	while (!list_empty(bufs)) {
+		buf = list_first_entry(bufs, struct smi2021_buf, list);
 		list_del(&buf->list);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
@@ -317,8 +971,8 @@ void smi2021_clear_queue(struct smi2021 *smi2021)
 #endif
 	}
 	/* It's important to clear current buffer */
-	if (smi2021->cur_buf) {
-		buf = smi2021->cur_buf;
+	if (*cur) {
+		buf = *cur;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
 		vb2_buffer_done(&buf->vb, VB2_BUF_STATE_ERROR);
 		dev_info(smi2021->dev, "buffer [%p/%d] aborted\n",
@@ -329,11 +983,37 @@ void smi2021_clear_queue(struct smi2021 *smi2021)
 				buf, buf->vb.vb2_buf.index);
 #endif
 	}
-	smi2021->cur_buf = NULL;
+	*cur = NULL;
 	spin_unlock_irqrestore(&smi2021->buf_lock, flags);
+}
+
+/* Must be called with both v4l2_lock and vb_queue_lock held */
+void smi2021_clear_queue(struct smi2021 *smi2021)
+{
+	dev_info(smi2021->dev, "clear_queue called\n");
+
+	/* The scratch frame isn't a vb2 buffer, and goes with the queue */
+	smi2021->vid_live = false;
+	if (smi2021->cur_buf == &smi2021->scratch)
+		smi2021->cur_buf = NULL;
+	smi2021->scratch_full = false;
+	vfree(smi2021->scratch.mem);
+	smi2021->scratch.mem = NULL;
+
+	smi2021_return_bufs(smi2021, &smi2021->avail_bufs, &smi2021->cur_buf);
 	dev_info(smi2021->dev, "returning from clear_queue\n");
 }
 
+/* Must be called with both v4l2_lock and vbi_queue_lock held */
+void smi2021_clear_vbi_queue(struct smi2021 *smi2021)
+{
+	smi2021->vbi_live = false;
+	smi2021_return_bufs(smi2021, &smi2021->avail_vbi_bufs,
+				&smi2021->cur_vbi_buf);
+	/* Don't finish the line into the buffer just returned */
+	smi2021->vbi_pos = -1;
+}
+
 int smi2021_vb2_setup(struct smi2021 *smi2021)
 {
 	int rc;
@@ -341,18 +1021,36 @@ int smi2021_vb2_setup(struct smi2021 *smi2021)
 
 	q = &smi2021->vb_vidq;
 	q->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	q->io_modes = VB2_READ | VB2_MMAP | VB2_USERPTR;
+	q->io_modes = VB2_READ | VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
 	q->drv_priv = smi2021;
 	q->buf_struct_size = sizeof(struct smi2021_buf);
 	q->ops = &smi2021_video_qops;
 	q->mem_ops = &vb2_vmalloc_memops;
-	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+			     V4L2_BUF_FLAG_TSTAMP_SRC_SOF;
 
 	rc = vb2_queue_init(q);
 	if (rc < 0)
 		return rc;
 
+	q = &smi2021->vb_vbiq;
+	q->type = V4L2_BUF_TYPE_VBI_CAPTURE;
+	q->io_modes = VB2_READ | VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+	q->drv_priv = smi2021;
+	q->buf_struct_size = sizeof(struct smi2021_buf);
+	q->ops = &smi2021_vbi_qops;
+	q->mem_ops = &vb2_vmalloc_memops;
+	q->timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+			     V4L2_BUF_FLAG_TSTAMP_SRC_SOF;
+
+	rc = vb2_queue_init(q);
+	if (rc < 0) {
+		vb2_queue_release(&smi2021->vb_vidq);
+		return rc;
+	}
+
 	INIT_LIST_HEAD(&smi2021->avail_bufs);
+	INIT_LIST_HEAD(&smi2021->avail_vbi_bufs);
 
 	return 0;
 }
@@ -386,5 +1084,26 @@ int smi2021_video_register(struct smi2021 *smi2021)
 	v4l2_info(&smi2021->v4l2_dev, "driver version %s, V4L2 device registered as %s\n",
 			SMI2021_DRIVER_VERSION, video_device_node_name(&smi2021->vdev));
 
+	/* The vbi node shares everything but the queue */
+	smi2021->vbi_dev = v4l_template;
+	strlcpy(smi2021->vbi_dev.name, "smi2021 vbi",
+					sizeof(smi2021->vbi_dev.name));
+	smi2021->vbi_dev.queue = &smi2021->vb_vbiq;
+	smi2021->vbi_dev.lock = &smi2021->v4l2_lock;
+	smi2021->vbi_dev.queue->lock = &smi2021->vbi_queue_lock;
+	smi2021->vbi_dev.v4l2_dev = &smi2021->v4l2_dev;
+
+	video_set_drvdata(&smi2021->vbi_dev, smi2021);
+	rc = video_register_device(&smi2021->vbi_dev, VFL_TYPE_VBI, -1);
+	if (rc < 0) {
+		dev_err(smi2021->dev, "vbi video_register_device failed (%d)\n",
+									rc);
+		video_unregister_device(&smi2021->vdev);
+		return rc;
+	}
+
+	v4l2_info(&smi2021->v4l2_dev, "VBI device registered as %s\n",
+			video_device_node_name(&smi2021->vbi_dev));
+
 	return 0;
 }
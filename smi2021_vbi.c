@@ -0,0 +1,179 @@
+/************************************************************************
+ * smi2021_vbi.c							*
+ *									*
+ * USB Driver for SMI2021 - EasyCap					*
+ * **********************************************************************
+ *
+ * Copyright 2011-2013 Jon Arne Jørgensen
+ * <jonjon.arnearne--a.t--gmail.com>
+ *
+ * Copyright 2011, 2012 Tony Brown, Michal Demin, Jeffry Johnston
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "smi2021.h"
+
+/*
+ * Software slicer for the raw VBI lines.
+ *
+ * The decoder sends the blanking lines as raw samples at 27 MHz,
+ * the first sample being SMI2021_*_VBI_OFFSET samples after 0H.
+ * Positions below are in samples from the start of the line we get,
+ * bit periods are in 1/256 samples.
+ */
+
+/* EIA-608 closed caption, 32 * fH, 7 cycles of clock run-in */
+#define CC_BIT			13728	/* 53.625 samples */
+#define CC_RUN_IN_START		39	/* 10.5 us */
+#define CC_RUN_IN_END		415	/* 24.4 us */
+#define CC_SEARCH_END		700
+
+/* EN 300 294 wide screen signalling, 5 MHz elements, 6 per bit */
+#define WSS_ELEMENT		1382	/* 5.4 samples */
+#define WSS_RUN_IN_START	33	/* 11.0 us */
+#define WSS_START_CODE_END	320
+#define WSS_SEARCH_END		400
+
+/* Anything weaker than this is noise, not data */
+#define VBI_MIN_AMPLITUDE	24
+
+/* Threshold halfway between the lowest and highest sample in [from, to) */
+static int smi2021_vbi_thresh(const u8 *p, int from, int to)
+{
+	int lo = 255, hi = 0;
+	int i;
+
+	for (i = from; i < to; i++) {
+		lo = min_t(int, lo, p[i]);
+		hi = max_t(int, hi, p[i]);
+	}
+
+	if (hi - lo < VBI_MIN_AMPLITUDE)
+		return -1;
+
+	return (lo + hi) / 2;
+}
+
+/*
+ * Find the first rising edge in [from, to) that follows at least gap
+ * samples below the threshold, and return the first sample above it.
+ */
+static int smi2021_vbi_edge(const u8 *p, int from, int to, int thresh,
+				int gap)
+{
+	int low = 0;
+	int i;
+
+	for (i = from; i < to; i++) {
+		if (p[i] < thresh) {
+			low++;
+			continue;
+		}
+		if (low >= gap)
+			return i;
+		low = 0;
+	}
+
+	return -1;
+}
+
+/* Three samples around pos, which is in 1/256 samples */
+static int smi2021_vbi_sample(const u8 *p, int pos)
+{
+	p += pos >> 8;
+	return p[-1] + p[0] + p[1];
+}
+
+/*
+ * The clock run-in is followed by two 0 start bits and a 1 start bit,
+ * the first rising edge after a long low is the start of the 1 bit.
+ * Then 2 bytes LSB first, each with odd parity in bit 7.
+ */
+bool smi2021_slice_cc(const u8 *p, u8 *data)
+{
+	int thresh, edge, pos, i;
+	u16 bits = 0;
+
+	thresh = smi2021_vbi_thresh(p, CC_RUN_IN_START, CC_RUN_IN_END);
+	if (thresh < 0)
+		return false;
+
+	/* Skip the blanking before the run-in */
+	edge = smi2021_vbi_edge(p, 0, CC_SEARCH_END, thresh, 1);
+	if (edge < 0)
+		return false;
+	edge = smi2021_vbi_edge(p, edge, CC_SEARCH_END, thresh,
+				CC_BIT * 3 / 2 / 256);
+	if (edge < 0)
+		return false;
+
+	/* The data ends right at the end of the line, it must all be there */
+	if (edge * 256 + CC_BIT * 33 / 2 >= (SMI2021_BYTES_PER_LINE - 1) * 256)
+		return false;
+
+	pos = edge * 256 + CC_BIT * 3 / 2;
+	for (i = 0; i < 16; i++, pos += CC_BIT)
+		if (smi2021_vbi_sample(p, pos) >= 3 * thresh)
+			bits |= 1 << i;
+
+	data[0] = bits & 0xff;
+	data[1] = bits >> 8;
+
+	return (hweight8(data[0]) & 1) && (hweight8(data[1]) & 1);
+}
+
+/*
+ * The run-in and start code have no more than three elements low in a
+ * row, except for the five right before the last rising edge of the
+ * start code. The 14 data bits follow, LSB first, each bit being three
+ * elements high then three low for 1, or the other way round for 0.
+ */
+bool smi2021_slice_wss(const u8 *p, u8 *data)
+{
+	int thresh, edge, pos, first, second, i;
+	u16 bits = 0;
+
+	thresh = smi2021_vbi_thresh(p, WSS_RUN_IN_START, WSS_START_CODE_END);
+	if (thresh < 0)
+		return false;
+
+	edge = smi2021_vbi_edge(p, 0, WSS_SEARCH_END, thresh, 1);
+	if (edge < 0)
+		return false;
+	edge = smi2021_vbi_edge(p, edge, WSS_SEARCH_END, thresh,
+				WSS_ELEMENT * 9 / 2 / 256);
+	if (edge < 0)
+		return false;
+
+	/* Centre of the first half of bit 0 */
+	pos = edge * 256 + WSS_ELEMENT * 5 + WSS_ELEMENT * 3 / 2;
+	for (i = 0; i < 14; i++, pos += 6 * WSS_ELEMENT) {
+		first = smi2021_vbi_sample(p, pos);
+		second = smi2021_vbi_sample(p, pos + 3 * WSS_ELEMENT);
+
+		/* Both halves at the same level isn't biphase */
+		if (abs(first - second) < 3 * VBI_MIN_AMPLITUDE / 2)
+			return false;
+		if (first > second)
+			bits |= 1 << i;
+	}
+
+	data[0] = bits & 0xff;
+	data[1] = bits >> 8;
+
+	/* Bit 3 is the odd parity of the aspect ratio group */
+	return hweight8(data[0] & 0x0f) & 1;
+}